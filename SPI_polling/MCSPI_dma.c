@@ -0,0 +1,332 @@
+/*
+* @file    MCSPI_dma.c
+* @author  Aniruddha Kanhere
+* @date    13 July 2019
+* @version 1
+* @brief   dmaengine based transfers for the MCSPI device driver. The data is
+*          moved through the DMA address aligned FIFO registers (DAFTX/DAFRX)
+*          from/to driver owned coherent buffers
+*/
+
+#include "MCSPI_misc.h"
+
+MODULE_LICENSE      ("GPL v2");                           ///< The license type -- this affects available functionality
+MODULE_AUTHOR       ("Aniruddha Kanhere");              ///< The author -- visible when you use modinfo
+MODULE_VERSION      ("1.0");                           ///< A version number to inform users
+
+static bool dma_test = FALSE;
+module_param(dma_test, bool, S_IRUGO);
+MODULE_PARM_DESC(dma_test, "Use a memcpy DMA channel that loops TX back to RX instead of the MCSPI DMA requests");
+
+
+//called by the dmaengine driver once the last descriptor of a block is done
+static void MCSPI_dma_callback(void *param)
+{
+  struct MCSPI_dma *dma = (struct MCSPI_dma *)param;
+  complete(&dma->done);
+}
+
+
+/*
+Queue a single entry slave-sg descriptor for a part of one of the coherent
+buffers. Only the descriptor that finishes last gets the callback.
+*/
+static int __queue_slave_sg(struct MCSPI_dma *dma, struct dma_chan *chan,
+                            dma_addr_t addr, unsigned int len,
+                            enum dma_transfer_direction dir, bool callback)
+{
+  struct dma_async_tx_descriptor *desc;
+  struct scatterlist sg;
+
+  //the buffer is already a DMA address, so the table is filled in by hand
+  sg_init_table(&sg, 1);
+  sg_dma_address(&sg) = addr;
+  sg_dma_len(&sg) = len;
+
+  desc = dmaengine_prep_slave_sg(chan, &sg, 1, dir, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+  if(!desc)
+    return -EIO;
+
+  if(callback)
+  {
+    desc->callback = MCSPI_dma_callback;
+    desc->callback_param = dma;
+  }
+
+  if(dma_submit_error(dmaengine_submit(desc)))
+    return -EIO;
+
+  return 0;
+}
+
+
+/*
+Point the TX/RX channels at the DMA aligned FIFO registers, using bursts of
+a FIFO chunk (the almost-empty/almost-full level programmed by MCSPI_fifo_set)
+*/
+static int __slave_config(struct MCSPI_dma *dma, int wl_bytes)
+{
+  struct dma_slave_config conf = {0};
+  int err;
+
+  conf.src_addr_width = wl_bytes;
+  conf.dst_addr_width = wl_bytes;
+  conf.src_maxburst = MCSPI_FIFO_CHUNK / wl_bytes;
+  conf.dst_maxburst = MCSPI_FIFO_CHUNK / wl_bytes;
+
+  conf.direction = DMA_MEM_TO_DEV;
+  conf.dst_addr = dma->phys_base + MCSPI_DAFTX;
+  err = dmaengine_slave_config(dma->tx_chan, &conf);
+  if(err)
+    return err;
+
+  conf.direction = DMA_DEV_TO_MEM;
+  conf.src_addr = dma->phys_base + MCSPI_DAFRX;
+  return dmaengine_slave_config(dma->rx_chan, &conf);
+}
+
+
+/*..............................................................................
+    @breif:      Request the DMA channels and allocate the bounce buffers
+    @parameters: data: the driver data, data->dma is filled in
+                 phys_base: physical address of the MCSPI registers, finds
+                           the DT node with its "tx0"/"rx0" DMA channels
+    @return:     0 on success; error otherwise (data->dma.tx_chan is NULL)
+..............................................................................*/
+int MCSPI_dma_init(struct MCSPI_data *data, phys_addr_t phys_base)
+{
+  struct MCSPI_dma *dma = &data->dma;
+  dma_cap_mask_t mask;
+  int err;
+
+  init_completion(&dma->done);
+  dma->phys_base = phys_base;
+  dma->test = dma_test;
+
+  if(dma->test)
+  {
+    dma_cap_zero(mask);
+    dma_cap_set(DMA_MEMCPY, mask);
+    dma->tx_chan = dma_request_chan_by_mask(&mask);
+    dma->rx_chan = dma->tx_chan;
+  }
+  else
+  {
+    //the platform device is registered by MCSPI_init and has no DT node or
+    //slave map, the EDMA requests of the McSPI are in its own DT node
+    struct device_node *np = MCSPI_of_node(phys_base);
+
+    if(np)
+    {
+      dma->tx_chan = of_dma_request_slave_channel(np, "tx0");
+      if(!IS_ERR(dma->tx_chan))
+      {
+        dma->rx_chan = of_dma_request_slave_channel(np, "rx0");
+        if(IS_ERR(dma->rx_chan))
+        {
+          dma_release_channel(dma->tx_chan);
+          dma->tx_chan = dma->rx_chan;
+        }
+      }
+      of_node_put(np);
+    }
+    else
+      dma->tx_chan = ERR_PTR(-ENODEV);
+  }
+
+  if(IS_ERR(dma->tx_chan))
+  {
+    err = PTR_ERR(dma->tx_chan);
+    DEBUG_ALERT("%s: DMA: no DMA channel (%d), DMA mode disabled\n", DRIVER_NAME, err);
+    dma->tx_chan = NULL;
+    dma->rx_chan = NULL;
+    return err;
+  }
+
+  dma->tx_buf = dma_alloc_coherent(dma->tx_chan->device->dev, MCSPI_DMA_BUF_SIZE, &dma->tx_dma, GFP_KERNEL);
+  dma->rx_buf = dma_alloc_coherent(dma->rx_chan->device->dev, MCSPI_DMA_BUF_SIZE, &dma->rx_dma, GFP_KERNEL);
+  if(!dma->tx_buf || !dma->rx_buf)
+  {
+    DEBUG_ALERT("%s: DMA: couldn't allocate the DMA buffers\n", DRIVER_NAME);
+    MCSPI_dma_release(data);
+    return -ENOMEM;
+  }
+
+  DEBUG_NORM("%s: DMA: %s channels ready\n", DRIVER_NAME, dma->test ? "memcpy test" : "MCSPI");
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Free the bounce buffers and give back the DMA channels
+    @parameters: data: the driver data
+    @return:     void
+..............................................................................*/
+void MCSPI_dma_release(struct MCSPI_data *data)
+{
+  struct MCSPI_dma *dma = &data->dma;
+
+  if(!dma->tx_chan)
+    return;
+
+  if(dma->tx_buf)
+    dma_free_coherent(dma->tx_chan->device->dev, MCSPI_DMA_BUF_SIZE, dma->tx_buf, dma->tx_dma);
+  if(dma->rx_buf)
+    dma_free_coherent(dma->rx_chan->device->dev, MCSPI_DMA_BUF_SIZE, dma->rx_buf, dma->rx_dma);
+
+  if(dma->rx_chan != dma->tx_chan)
+    dma_release_channel(dma->rx_chan);
+  dma_release_channel(dma->tx_chan);
+
+  dma->tx_buf = NULL;
+  dma->rx_buf = NULL;
+  dma->tx_chan = NULL;
+  dma->rx_chan = NULL;
+}
+
+
+/*
+Loop one block back from the TX to the RX buffer on the memcpy test channel.
+Goes through the same submit/issue/complete steps as the real transfer.
+*/
+static int __send_block_test(struct MCSPI_dma *dma, int len, unsigned long timeout)
+{
+  struct dma_async_tx_descriptor *desc;
+
+  desc = dmaengine_prep_dma_memcpy(dma->tx_chan, dma->rx_dma, dma->tx_dma, len,
+                                   DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+  if(!desc)
+    return -EIO;
+
+  desc->callback = MCSPI_dma_callback;
+  desc->callback_param = dma;
+
+  reinit_completion(&dma->done);
+  if(dma_submit_error(dmaengine_submit(desc)))
+    return -EIO;
+  dma_async_issue_pending(dma->tx_chan);
+
+  if(!wait_for_completion_timeout(&dma->done, msecs_to_jiffies(timeout) + 1))
+  {
+    dmaengine_terminate_all(dma->tx_chan);
+    return -ETIME;
+  }
+  return 0;
+}
+
+
+/*
+Send one block from the TX buffer through DAFTX (and receive it into the RX
+buffer through DAFRX in TX_RX). WCNT is the block length so the module stops
+on its own at the end.
+*/
+static int __send_block(struct MCSPI *dev, struct MCSPI_dma *dma, int len, unsigned long timeout)
+{
+  int ch = dev->channel_number;
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  bool rx = (dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX);
+  int err;
+
+  reinit_completion(&dma->done);
+
+  //RX first, it is the one that finishes last
+  if(rx)
+  {
+    err = __queue_slave_sg(dma, dma->rx_chan, dma->rx_dma, len, DMA_DEV_TO_MEM, TRUE);
+    if(err)
+      return err;
+  }
+
+  err = __queue_slave_sg(dma, dma->tx_chan, dma->tx_dma, len, DMA_MEM_TO_DEV, !rx);
+  if(err)
+  {
+    dmaengine_terminate_all(dma->rx_chan);
+    return err;
+  }
+
+  if(rx)
+    dma_async_issue_pending(dma->rx_chan);
+  dma_async_issue_pending(dma->tx_chan);
+
+  //WCNT can only be changed while the channel is off
+  MCSPI_enable(dev, 0);
+  MCSPI_write_reg(dev->base_addr, MCSPI_XFERLEVEL,
+                  MCSPI_XFERLEVEL_AEL(MCSPI_FIFO_CHUNK - 1) |
+                  MCSPI_XFERLEVEL_AFL(MCSPI_FIFO_CHUNK - 1) |
+                  MCSPI_XFERLEVEL_WCNT(len / wl_bytes));
+  MCSPI_dma_set(dev, 1);
+  MCSPI_enable(dev, 1);
+
+  if(!wait_for_completion_timeout(&dma->done, msecs_to_jiffies(timeout) + 1))
+  {
+    dmaengine_terminate_all(dma->tx_chan);
+    if(rx)
+      dmaengine_terminate_all(dma->rx_chan);
+    MCSPI_dma_set(dev, 0);
+    return -ETIME;
+  }
+
+  MCSPI_dma_set(dev, 0);
+
+  //the TX DMA is done once the last word is in the FIFO, not on the wire
+  if(MCSPI_wait_for_bit_set_sleep(dev->base_addr + MCSPI_CHSTAT(ch), MCSPI_CHSTAT_EOT_MASK,
+                                  rx ? 0 : MCSPI_xfer_time_ns(dev, MCSPI_FIFO_DEPTH / wl_bytes), timeout) < 0)
+    return -ETIME;
+
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Send the data with the DMA, in blocks of MCSPI_DMA_BUF_SIZE
+    @parameters: data: struct holding the device and the DMA state
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
+    @return:     0 on success; -ETIME on timeout, other error otherwise
+..............................................................................*/
+int MCSPI_send_data_dma(struct MCSPI_data *data, void* msg, int len)
+{
+  struct MCSPI *dev = data->device;
+  struct MCSPI_dma *dma = &data->dma;
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  bool rx = (dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX);
+  unsigned long timeout;
+  int offset, block, err;
+
+  //only channel 0 has its DMA requests wired up ("tx0"/"rx0"), and the FIFO
+  //is not enabled for receive only transfers (see MCSPI_fifo_set)
+  if(!dma->tx_chan || dev->channel_number != 0 || dev->tx_rx == MCSPI_CHCONF_TRM_RX)
+    return MCSPI_send_data_irq(data, msg, len);
+
+  if(!dma->test)
+  {
+    err = __slave_config(dma, wl_bytes);
+    if(err)
+      return err;
+  }
+
+  DEBUG_NORM("%s: Send: sending %d bytes with the DMA\n", DRIVER_NAME, len);
+
+  for(offset = 0 ; offset < len ; offset += block)
+  {
+    block = min(len - offset, MCSPI_DMA_BUF_SIZE);
+
+    timeout = MCSPI_xfer_timeout_ms(dev, block/wl_bytes);
+
+    memcpy(dma->tx_buf, (u8 *)msg + offset, block);
+
+    if(dma->test)
+      err = __send_block_test(dma, block, timeout);
+    else
+      err = __send_block(dev, dma, block, timeout);
+
+    if(err)
+      return err;
+
+    if(rx)
+      memcpy((u8 *)msg + offset, dma->rx_buf, block);
+  }
+
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*
+* @file    MCSPI_dma.h
+* @author  Aniruddha Kanhere
+* @date    13 July 2019
+* @version 1
+* @brief   Prototypes and structs for the dmaengine based transfers of the
+*          MCSPI device driver
+*/
+
+#ifndef _MCSPI_DMA_H_
+#define _MCSPI_DMA_H_
+
+#include <linux/dmaengine.h>      // Required for the dmaengine slave API
+#include <linux/dma-mapping.h>    // Required for dma_alloc_coherent
+#include <linux/scatterlist.h>    // Required for the slave-sg descriptors
+#include <linux/completion.h>
+#include <linux/of_dma.h>         // Required for the channels of the McSPI DT node
+
+//size of each of the coherent TX/RX bounce buffers. Longer messages are sent
+//in blocks of this size
+#define MCSPI_DMA_BUF_SIZE        (16*1024)
+
+struct MCSPI_data;
+
+struct MCSPI_dma{
+  struct dma_chan *tx_chan;   //NULL if DMA is not available
+  struct dma_chan *rx_chan;   //same as tx_chan for the memcpy test channel
+  void *tx_buf;
+  void *rx_buf;
+  dma_addr_t tx_dma;
+  dma_addr_t rx_dma;
+  phys_addr_t phys_base;      //physical address of the MCSPI registers
+  bool test;                  //memcpy loopback instead of the MCSPI FIFO
+  struct completion done;
+};
+
+
+/*..............................................................................
+    @breif:      Request the DMA channels and allocate the bounce buffers. With
+                 the dma_test module parameter set a memcpy channel is used
+                 instead of the MCSPI TX/RX requests and the data is looped
+                 back from the TX into the RX buffer, so the queuing and
+                 completion can be measured without the EDMA
+    @parameters: data: the driver data, data->dma is filled in
+                 phys_base: physical address of the MCSPI registers, finds
+                           the DT node with its "tx0"/"rx0" DMA channels
+    @return:     0 on success; error otherwise (data->dma.tx_chan is NULL)
+..............................................................................*/
+int MCSPI_dma_init(struct MCSPI_data *data, phys_addr_t phys_base);
+void MCSPI_dma_release(struct MCSPI_data *data);
+
+
+/*..............................................................................
+    @breif:      Send the data with the DMA, in blocks of MCSPI_DMA_BUF_SIZE
+    @parameters: data: struct holding the device and the DMA state
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
+    @return:     0 on success; -ETIME on timeout, other error otherwise
+..............................................................................*/
+int MCSPI_send_data_dma(struct MCSPI_data *data, void* msg, int len);
+
+#endif
@@ -19,77 +19,1660 @@ MODULE_VERSION      ("1.0");                           ///< A version number to
 /*..............................................................................
     @breif:      Send the data using polling
     @parameters: dev: struct defining device
-                 msg: the char* msg which you want to send
-                 len: the length of the message you'll be 
-                      sending
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
     @return:     CONFIGURE_SUCCESS/CONFIGURE_FAIL
 ..............................................................................*/
-int MCSPI_send_data_poll(struct MCSPI *dev, char* msg, int len)
+int MCSPI_send_data_poll(struct MCSPI *dev, void* msg, int len)
 {
-  struct MCSPI_data data_var;
-  struct MCSPI_data *mcspi_data = &data_var;
-  long int timeout = ( ((u32)(dev->clock_div+1)) * 2 * 1000 * (dev->word_length+1) )/48000000;
-  //clock_dividor * factor_of_safety * convertsion_to_ms * number_of_bits /Clock_speed
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  int words = len / wl_bytes;
+  u64 word_ns = MCSPI_xfer_time_ns(dev, 1);
+  unsigned int timeout = MCSPI_xfer_timeout_ms(dev, 1);
+  bool rx = (dev->tx_rx == MCSPI_CHCONF_TRM_RX || dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX);
 
-  int bytes;
+  int word;
   void __iomem *channel_stat = NULL;
   u32 channel_tx = 0, channel_rx = 0;
 
-  mcspi_data->device = dev;
+  switch(dev->channel_number)
+  {
+    default:
+    case 0: channel_stat = dev->base_addr + MCSPI_CH0STAT;
+            channel_tx = MCSPI_TX0;
+            channel_rx = MCSPI_RX0;
+            break;
+    case 1: channel_stat = dev->base_addr + MCSPI_CH1STAT;
+            channel_tx = MCSPI_TX1;
+            channel_rx = MCSPI_RX1;
+            break;
+    case 2: channel_stat = dev->base_addr + MCSPI_CH2STAT;
+            channel_tx = MCSPI_TX2;
+            channel_rx = MCSPI_RX2;
+            break;
+    case 3: channel_stat = dev->base_addr + MCSPI_CH3STAT;
+            channel_tx = MCSPI_TX3;
+            channel_rx = MCSPI_RX3;
+            break;
+  }
+
+  DEBUG_NORM("%s: Send: sending %d words\n", DRIVER_NAME, words);
+
+  for(word = 0 ; word < words ; word++)
+  {
+    MCSPI_write_reg(dev->base_addr, channel_tx, __get_word(msg, word, wl_bytes));
+    mb();
+
+    DEBUG_NORM("Send: sent 0x%x -- \n\n", __get_word(msg, word, wl_bytes));
+
+    //transmit only: the word before is still shifting out, the register
+    //only frees up when it is done
+    if(MCSPI_wait_for_bit_set_sleep(channel_stat, MCSPI_CHSTAT_TXS_MASK,
+                                    (rx || word == 0) ? 0 : word_ns, timeout) < 0)
+      return -ETIME;
+
+
+    if(rx)
+    {
+      if(MCSPI_wait_for_bit_set_sleep(channel_stat, MCSPI_CHSTAT_RXS_MASK, word_ns, timeout) < 0)
+        return -ETIME;
+
+      __put_word(msg, word, wl_bytes, MCSPI_read_reg(dev->base_addr, channel_rx));
+    }
+  }
+
+  if(MCSPI_wait_for_bit_set_sleep(channel_stat, MCSPI_CHSTAT_EOT_MASK, rx ? 0 : word_ns, timeout) < 0)
+    return -ETIME;
+
+  return 0;
+}
+
+
+
+/*..............................................................................
+    @breif:      Send the data through the channel FIFO. The TX FIFO is topped
+                 up by a chunk every time it drains to the almost-empty level
+                 and the RX FIFO is read out a chunk at a time, so the status is
+                 polled once per chunk instead of once per word
+    @parameters: dev: struct defining device
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
+    @return:     0 on success; -ETIME on timeout
+..............................................................................*/
+int MCSPI_send_data_fifo(struct MCSPI *dev, void* msg, int len)
+{
+  //a chunk is on the wire between two almost-empty/almost-full events
+  u32 chunk_words = MCSPI_FIFO_CHUNK / MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  u64 chunk_ns = MCSPI_xfer_time_ns(dev, chunk_words);
+  u64 word_ns = MCSPI_xfer_time_ns(dev, 1);
+  unsigned int timeout = MCSPI_xfer_timeout_ms(dev, chunk_words);
+
+  void __iomem *irq_stat = dev->base_addr + MCSPI_IRQSTATUS;
+  void __iomem *channel_stat = dev->base_addr + MCSPI_CHSTAT(dev->channel_number);
+  u32 channel_tx = MCSPI_TX(dev->channel_number);
+  u32 channel_rx = MCSPI_RX(dev->channel_number);
+  u32 tx_empty = MCSPI_IRQ_TX_EMPTY_MASK(dev->channel_number);
+  u32 rx_full = MCSPI_IRQ_RX_FULL_MASK(dev->channel_number);
+  bool rx = (dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX);
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  int words = len / wl_bytes;
+  int chunk = MCSPI_FIFO_CHUNK / wl_bytes;     //FIFO levels are in bytes
+  int tx_count = 0, rx_count = 0, i;
+
+  //the FIFO is not enabled for receive only transfers (see MCSPI_fifo_set)
+  if(dev->tx_rx == MCSPI_CHCONF_TRM_RX)
+    return MCSPI_send_data_poll(dev, msg, len);
+
+  DEBUG_NORM("%s: Send: sending %d words through the FIFO\n", DRIVER_NAME, words);
+
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, tx_empty | rx_full);
+
+  while(tx_count < words)
+  {
+    if(MCSPI_wait_for_bit_set_sleep(irq_stat, tx_empty, tx_count ? chunk_ns : 0, timeout) < 0)
+      return -ETIME;
+    MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, tx_empty);
+
+    for(i = 0 ; i < chunk && tx_count < words ; i++, tx_count++)
+      MCSPI_write_reg(dev->base_addr, channel_tx, __get_word(msg, tx_count, wl_bytes));
+
+    //never let more than the RX FIFO can hold be in flight
+    while(rx && tx_count - rx_count > chunk)
+    {
+      if(MCSPI_wait_for_bit_set_sleep(irq_stat, rx_full, chunk_ns, timeout) < 0)
+        return -ETIME;
+      MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, rx_full);
+
+      for(i = 0 ; i < chunk ; i++, rx_count++)
+        __put_word(msg, rx_count, wl_bytes, MCSPI_read_reg(dev->base_addr, channel_rx));
+    }
+  }
+
+  if(rx)
+  {
+    //whatever is left is less than a chunk or two, pick it up word by word
+    while(rx_count < words)
+    {
+      if(MCSPI_wait_for_bit_reset(channel_stat, MCSPI_CHSTAT_RXFFE_MASK, timeout) < 0)
+        return -ETIME;
+
+      __put_word(msg, rx_count++, wl_bytes, MCSPI_read_reg(dev->base_addr, channel_rx));
+    }
+  }
+  else if(MCSPI_wait_for_bit_set_sleep(channel_stat, MCSPI_CHSTAT_TXFFE_MASK, chunk_ns, timeout) < 0)
+    return -ETIME;
+
+  //the FIFO is empty, only the last word is still shifting
+  if(MCSPI_wait_for_bit_set_sleep(channel_stat, MCSPI_CHSTAT_EOT_MASK, rx ? 0 : word_ns, timeout) < 0)
+    return -ETIME;
+
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Send the data through the FIFO with the word count (WCNT) of
+                 every block of up to 65535 words programmed into the module,
+                 so the end of the block is found by the module: the FIFO is
+                 fed a chunk per almost-empty/almost-full event and the end is
+                 waited for once per block (EOW, then EOT), with no status
+                 poll per word, not even for the last words received
+    @parameters: dev: struct defining device
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
+    @return:     0 on success; -ETIME on timeout
+..............................................................................*/
+int MCSPI_send_data_bulk(struct MCSPI *dev, void* msg, int len)
+{
+  u32 chunk_words = MCSPI_FIFO_CHUNK / MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  u64 chunk_ns = MCSPI_xfer_time_ns(dev, chunk_words);
+  u64 word_ns = MCSPI_xfer_time_ns(dev, 1);
+  unsigned int timeout = MCSPI_xfer_timeout_ms(dev, 2*chunk_words);
+
+  void __iomem *irq_stat = dev->base_addr + MCSPI_IRQSTATUS;
+  void __iomem *channel_stat = dev->base_addr + MCSPI_CHSTAT(dev->channel_number);
+  u32 channel_tx = MCSPI_TX(dev->channel_number);
+  u32 channel_rx = MCSPI_RX(dev->channel_number);
+  u32 tx_empty = MCSPI_IRQ_TX_EMPTY_MASK(dev->channel_number);
+  u32 rx_full = MCSPI_IRQ_RX_FULL_MASK(dev->channel_number);
+  bool rx = (dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX);
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  int words = len / wl_bytes;
+  int chunk = MCSPI_FIFO_CHUNK / wl_bytes;
+  int offset, block, tx_count, rx_count, i;
+
+  //the FIFO is not enabled for receive only transfers (see MCSPI_fifo_set)
+  if(dev->tx_rx == MCSPI_CHCONF_TRM_RX)
+    return MCSPI_send_data_poll(dev, msg, len);
+
+  DEBUG_NORM("%s: Send: sending %d words in WCNT blocks\n", DRIVER_NAME, words);
+
+  for(offset = 0 ; offset < words ; offset += block)
+  {
+    block = min(words - offset, MCSPI_XFER_WCNT_MAX);
+    tx_count = 0;
+    rx_count = 0;
+
+    //WCNT can only be changed while the channel is off
+    MCSPI_enable(dev, 0);
+    MCSPI_write_reg(dev->base_addr, MCSPI_XFERLEVEL,
+                    MCSPI_XFERLEVEL_AEL(MCSPI_FIFO_CHUNK - 1) |
+                    MCSPI_XFERLEVEL_AFL(MCSPI_FIFO_CHUNK - 1) |
+                    MCSPI_XFERLEVEL_WCNT(block));
+    MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, tx_empty | rx_full | MCSPI_IRQ_EOW);
+    MCSPI_enable(dev, 1);
+
+    while(tx_count < block)
+    {
+      if(MCSPI_wait_for_bit_set_sleep(irq_stat, tx_empty, tx_count ? chunk_ns : 0, timeout) < 0)
+        return -ETIME;
+      MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, tx_empty);
+
+      for(i = 0 ; i < chunk && tx_count < block ; i++, tx_count++)
+        MCSPI_write_reg(dev->base_addr, channel_tx, __get_word(msg, offset + tx_count, wl_bytes));
+
+      //never let more than the RX FIFO can hold be in flight
+      while(rx && tx_count - rx_count > chunk)
+      {
+        if(MCSPI_wait_for_bit_set_sleep(irq_stat, rx_full, chunk_ns, timeout) < 0)
+          return -ETIME;
+        MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, rx_full);
+
+        for(i = 0 ; i < chunk ; i++, rx_count++)
+          __put_word(msg, offset + rx_count, wl_bytes, MCSPI_read_reg(dev->base_addr, channel_rx));
+      }
+    }
+
+    //the module counts the words, EOW once the last one went out and EOT
+    //once it is through the shift register (and in the RX FIFO)
+    if(MCSPI_wait_for_bit_set_sleep(irq_stat, MCSPI_IRQ_EOW, chunk_ns, timeout) < 0)
+      return -ETIME;
+    MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, MCSPI_IRQ_EOW);
+
+    if(MCSPI_wait_for_bit_set_sleep(channel_stat, MCSPI_CHSTAT_EOT_MASK, word_ns, timeout) < 0)
+      return -ETIME;
+
+    //what is left of the block is in the RX FIFO by now
+    while(rx && rx_count < block)
+      __put_word(msg, offset + rx_count++, wl_bytes, MCSPI_read_reg(dev->base_addr, channel_rx));
+  }
+
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Send the data from the IRQ handler. The word count (WCNT) is
+                 programmed for every block of up to 65535 words, the handler
+                 keeps the FIFO fed on TX_EMPTY/RX_FULL and completes the block
+                 on EOW, while the caller sleeps on the completion.
+    @parameters: data: struct holding the device and the transfer state
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
+    @return:     0 on success; -ETIME on timeout
+..............................................................................*/
+int MCSPI_send_data_irq(struct MCSPI_data *data, void* msg, int len)
+{
+  struct MCSPI *dev = data->device;
+  struct MCSPI_xfer *xfer = &data->xfer;
+  int ch = dev->channel_number;
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  int words = len / wl_bytes;
+  int offset;
+  unsigned long timeout;
+
+  //the FIFO is not enabled for receive only transfers (see MCSPI_fifo_set)
+  if(dev->tx_rx == MCSPI_CHCONF_TRM_RX || !data->irq)
+    return MCSPI_send_data_poll(dev, msg, len);
+
+  DEBUG_NORM("%s: Send: sending %d words from the IRQ handler\n", DRIVER_NAME, words);
+
+  for(offset = 0 ; offset < words ; offset += xfer->words)
+  {
+    xfer->buf = (u8 *)msg + offset*wl_bytes;
+    xfer->words = min(words - offset, MCSPI_XFER_WCNT_MAX);
+    xfer->wl_bytes = wl_bytes;
+    xfer->chunk = MCSPI_FIFO_CHUNK / wl_bytes;
+    xfer->tx_count = 0;
+    xfer->rx_count = 0;
+    xfer->rx = (dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX);
+    xfer->eot_us = div_u64(MCSPI_xfer_time_ns(dev, 2), NSEC_PER_USEC) + 1;
+    xfer->status = -ETIME;
+    xfer->irq_enabled = MCSPI_IRQ_TX_EMPTY_MASK(ch) | MCSPI_IRQ_EOW;
+    if(xfer->rx)
+      xfer->irq_enabled |= MCSPI_IRQ_RX_FULL_MASK(ch);
+    reinit_completion(&xfer->done);
+
+    timeout = MCSPI_xfer_timeout_ms(dev, xfer->words);
+
+    //WCNT can only be changed while the channel is off
+    MCSPI_enable(dev, 0);
+    MCSPI_write_reg(dev->base_addr, MCSPI_XFERLEVEL,
+                    MCSPI_XFERLEVEL_AEL(MCSPI_FIFO_CHUNK - 1) |
+                    MCSPI_XFERLEVEL_AFL(MCSPI_FIFO_CHUNK - 1) |
+                    MCSPI_XFERLEVEL_WCNT(xfer->words));
+    MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, MCSPI_IRQ_RESET);
+    MCSPI_write_reg(dev->base_addr, MCSPI_IRQENABLE, xfer->irq_enabled);
+    MCSPI_enable(dev, 1);
+
+    if(!wait_for_completion_timeout(&xfer->done, msecs_to_jiffies(timeout) + 1))
+    {
+      //stop the word count and make sure the handler is out of msg before
+      //the caller frees it
+      MCSPI_write_reg(dev->base_addr, MCSPI_IRQENABLE, 0);
+      xfer->irq_enabled = 0;
+      synchronize_irq(data->irq);
+      MCSPI_enable(dev, 0);
+      xfer->buf = NULL;
+      return xfer->status;
+    }
+
+    //the handler found fewer words in the RX FIFO than were clocked
+    if(xfer->status)
+      return xfer->status;
+  }
+
+  if(MCSPI_wait_for_bit_set(dev->base_addr + MCSPI_CHSTAT(ch), MCSPI_CHSTAT_EOT_MASK, 1) < 0)
+    return -ETIME;
+
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Send the data using the transfer mode selected in
+                 data->device->xfer_mode. The caller holds the bus lock
+    @parameters: data: struct holding the device and the transfer state
+                 msg: the packed words which you want to send
+                 len: the length of the message in bytes (a multiple of
+                      the word size)
+    @return:     0 on success; -ETIME on timeout
+..............................................................................*/
+int MCSPI_send_data(struct MCSPI_data *data, void* msg, int len)
+{
+  struct MCSPI *dev = data->device;
+
+  switch(dev->xfer_mode)
+  {
+    case MCSPI_XFER_MODE_FIFO: return MCSPI_send_data_fifo(dev, msg, len);
+    case MCSPI_XFER_MODE_BULK: return MCSPI_send_data_bulk(dev, msg, len);
+    case MCSPI_XFER_MODE_IRQ:  return MCSPI_send_data_irq(data, msg, len);
+    case MCSPI_XFER_MODE_DMA:  return MCSPI_send_data_dma(data, msg, len);
+
+    default:
+    case MCSPI_XFER_MODE_POLL: return MCSPI_send_data_poll(dev, msg, len);
+  }
+}
+
+
+/*
+MCSPI_bus_lock; with idle_only the module is only taken if no client has it
+configured (-EALREADY otherwise). data->active is looked at under the lock and
+after the resume, which clears it.
+*/
+static int __bus_lock(struct MCSPI_client *client, bool idle_only)
+{
+  struct MCSPI_data *data = client->data;
+
+  mutex_lock(&data->bus_lock);
+
+  //the clock may have been gated, resuming puts the registers back
+  //the reference is given back the same way as in MCSPI_bus_unlock, so the
+  //clock is gated autosuspend_ms after the last use either way
+  if(pm_runtime_get_sync(&data->pdev->dev) < 0)
+  {
+    MCSPI_bus_unlock(client);
+    return -EBUSY;
+  }
+
+  //a slave capture/response mode keeps the module until it is stopped
+  if(data->capture.client || data->responder)
+  {
+    MCSPI_bus_unlock(client);
+    return -EBUSY;
+  }
+
+  if(idle_only && data->active)
+  {
+    MCSPI_bus_unlock(client);
+    return -EALREADY;
+  }
+
+  data->device = &client->config;
+  if(data->active == client)
+    return 0;
+
+  if(MCSPI_bus_setup(client))
+  {
+    MCSPI_bus_unlock(client);
+    return -EBUSY;
+  }
+
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Take the bus for a message of the client. If the module was
+                 last used by another client it is configured for this one
+    @parameters: client: the client which wants the bus
+    @return:     0 on success, with data->bus_lock held; -EBUSY if the module
+                 couldn't be configured or a slave capture/response mode has
+                 it (the lock is not held then)
+..............................................................................*/
+int MCSPI_bus_lock(struct MCSPI_client *client)
+{
+  return __bus_lock(client, FALSE);
+}
+
+
+/*..............................................................................
+    @breif:      Configure the module for the client if no client has it yet
+                 (first open, after a failed configuration or a resume), so
+                 e.g. the idle level of the CS is right before any message
+    @parameters: client: the client
+    @return:     void
+..............................................................................*/
+void MCSPI_bus_claim_idle(struct MCSPI_client *client)
+{
+  if(__bus_lock(client, TRUE) == 0)
+    MCSPI_bus_unlock(client);
+}
+
+
+/*..............................................................................
+    @breif:      Configure the module for the client. Only the fields which
+                 differ from what the module is set up with are written, the
+                 soft reset is done only when the module is not configured yet
+                 (first open, or after a failed configuration). The channel
+                 which had the bus before is switched off and gives up the FIFO
+    @parameters: client: the client, with data->bus_lock held
+    @return:     CONFIGURE_SUCCESS/CONFIGURE_FAIL
+..............................................................................*/
+int MCSPI_bus_setup(struct MCSPI_client *client)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI *mcspi = &client->config;
+  int err;
+
+  data->device = mcspi;
+
+  if(!data->configured)
+  {
+    //the reset switches off and clears every channel
+    err = MCSPI_configure(mcspi);
+  }
+  else
+  {
+    //only one channel may have the FIFO (and be enabled) at a time
+    if(data->channel != mcspi->channel_number)
+      MCSPI_channel_release(mcspi, data->channel);
+
+    //role and CS sensitivity only go to the MODULCTRL shadow, it is written
+    //with the channel below while the channel is off
+    if(data->role != mcspi->role || data->CS_sensitive != mcspi->CS_sensitive)
+      MCSPI_mode_set(mcspi);
+    err = MCSPI_configure_channel(mcspi);
+  }
+
+  data->configured = !err;
+  data->role = mcspi->role;
+  data->CS_sensitive = mcspi->CS_sensitive;
+
+  if(err)
+  {
+    DEBUG_ALERT("%s: Bus: configuration failed. (Check logs for more info)\n", DRIVER_NAME);
+    data->active = NULL;
+    return CONFIGURE_FAIL;
+  }
+
+  MCSPI_enable(mcspi, 1);
+  data->active = client;
+  data->channel = mcspi->channel_number;
+  return CONFIGURE_SUCCESS;
+}
+
+
+static int __configure_channel(struct MCSPI *mcspi);
+
+/*..............................................................................
+    @breif:      Check the settings of a profile and work out its MODULCTRL and
+                 CHxCONF words, without touching the hardware
+    @parameters: client: the client, with data->bus_lock held
+                 index: the profile (0 to MCSPI_NUM_PROFILES-1)
+                 config: the settings, for the channel of the client
+    @return:     0 on success; -EINVAL if the settings are not valid
+..............................................................................*/
+int MCSPI_profile_set(struct MCSPI_client *client, unsigned int index, const struct MCSPI *config)
+{
+  struct MCSPI_profile *profile = &client->profiles[index];
+  struct MCSPI_regs regs = client->data->regs;   //worked out on a copy
+  struct MCSPI tmp = *config;
+
+  if(config->channel_number < 0 || config->channel_number >= MCSPI_NUM_CHANNELS)
+    return -EINVAL;
+
+  //the bits the settings don't cover (FORCE, DMA, ...) are clear between
+  //messages, so the copy of the shadows is a good starting point
+  tmp.regs = &regs;
+  MCSPI_mode_set(&tmp);
+  if(__configure_channel(&tmp))
+    return -EINVAL;
+
+  //the DMA requests are only on during a DMA transfer, never in the words
+  profile->config = *config;
+  profile->modulctrl = regs.modulctrl & ~MCSPI_MODULCTRL_FDAA(1);
+  profile->chconf = regs.chconf[config->channel_number] &
+                    ~(MCSPI_CHCONF_DMAW(1) | MCSPI_CHCONF_DMAR(1));
+  profile->valid = TRUE;
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Make a registered profile the settings of the client and load
+                 its precomputed words into the module
+    @parameters: client: the client, with data->bus_lock held
+                 index: the profile (0 to MCSPI_NUM_PROFILES-1)
+    @return:     0 on success; -EINVAL if there's no such profile; -EBUSY if
+                 the module couldn't be configured
+..............................................................................*/
+int MCSPI_profile_activate(struct MCSPI_client *client, unsigned int index)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI *mcspi = &client->config;
+  struct MCSPI_profile *profile = &client->profiles[index];
+  unsigned int async = mcspi->async;
+  unsigned int stream = mcspi->stream;
+  unsigned int xfer_mode = mcspi->xfer_mode;
+
+  if(!profile->valid)
+    return -EINVAL;
+
+  *mcspi = profile->config;
+  mcspi->async = async;         //not part of a profile
+  mcspi->stream = stream;
+
+  //the precomputed words are only good on top of trusted shadows
+  if(!data->configured || data->active != client)
+    return MCSPI_bus_setup(client) ? -EBUSY : 0;
+
+  //a new transfer mode starts from the plain levels with no word count, the
+  //way the one before may have left XFERLEVEL doesn't matter
+  MCSPI_regs_load(mcspi, profile->modulctrl, profile->chconf);
+  if(mcspi->regs->dirty || mcspi->xfer_mode == MCSPI_XFER_MODE_FIFO ||
+     mcspi->xfer_mode != xfer_mode)
+  {
+    MCSPI_enable(mcspi, 0);
+    MCSPI_regs_flush(mcspi);
+    MCSPI_fifo_levels_set(mcspi);
+  }
+  MCSPI_enable(mcspi, 1);
+
+  data->role = mcspi->role;
+  data->CS_sensitive = mcspi->CS_sensitive;
+  return 0;
+}
+
+
+void MCSPI_bus_unlock(struct MCSPI_client *client)
+{
+  struct device *dev = &client->data->pdev->dev;
+
+  pm_runtime_mark_last_busy(dev);
+  pm_runtime_put_autosuspend(dev);
+  mutex_unlock(&client->data->bus_lock);
+}
+
+
+/*
+Start/end of a message with the CS held (FORCE, master mode only). In the
+streaming mode (dev->stream) a message of MCSPI_TURBO_MIN_WORDS words or more
+also gets TURBO, so the words follow each other without idle cycles. Returns
+whether TURBO went on, which __stream_end takes back.
+*/
+static bool __stream_begin(struct MCSPI *dev, int words)
+{
+  bool turbo = dev->stream && words >= MCSPI_TURBO_MIN_WORDS;
+
+  if(turbo)
+  {
+    MCSPI_enable(dev, 0);
+    MCSPI_turbo_set(dev, 1);
+    MCSPI_enable(dev, 1);
+  }
+
+  MCSPI_cs_force(dev, 1);
+  return turbo;
+}
+
+static void __stream_end(struct MCSPI *dev, bool turbo)
+{
+  MCSPI_cs_force(dev, 0);
+
+  if(turbo)
+  {
+    MCSPI_enable(dev, 0);
+    MCSPI_turbo_set(dev, 0);
+    MCSPI_enable(dev, 1);
+  }
+}
+
+
+/*..............................................................................
+    @breif:      Send one message of the client, the caller holds the bus lock.
+                 In the streaming mode (master) the CS is held for the whole
+                 message, with TURBO if it is long
+    @parameters: client: the client sending
+                 msg: the packed words, overwritten with the received data
+                 len: the length in bytes
+    @return:     0 on success; error otherwise
+..............................................................................*/
+int MCSPI_send_stream(struct MCSPI_client *client, void* msg, int len)
+{
+  struct MCSPI *dev = &client->config;
+  bool stream = (dev->stream && dev->role == MCSPI_MODULCTRL_MASTER);
+  bool turbo = FALSE;
+  int err;
+
+  if(stream)
+    turbo = __stream_begin(dev, len / MCSPI_CHCONF_WL_BYTES(dev->word_length));
+
+  err = MCSPI_send_data(client->data, msg, len);
+
+  if(stream)
+    __stream_end(dev, turbo);
+
+  return err;
+}
+
+
+/*..............................................................................
+    @breif:      Send one message of the client under the bus lock and queue
+                 what was received for read(). In the streaming mode (master)
+                 the CS is held for the whole message, with TURBO if it is long
+    @parameters: client: the client sending
+                 msg: the packed words, overwritten with the received data
+                 len: the length in bytes
+    @return:     0 on success; error otherwise
+..............................................................................*/
+int MCSPI_transfer(struct MCSPI_client *client, void* msg, int len)
+{
+  int err;
+
+  err = MCSPI_bus_lock(client);
+  if(err)
+    return err;
+
+  err = MCSPI_send_stream(client, msg, len);
+
+  //the engines leave the received words in msg, hand them on to read()
+  if(!err && client->config.tx_rx != MCSPI_CHCONF_TRM_TX)
+    MCSPI_rx_push(client, msg, len);
+
+  MCSPI_bus_unlock(client);
+  return err;
+}
+
+
+/*..............................................................................
+    @breif:      Send all the segments of an iov_iter (writev) as one transfer:
+                 the bus is taken once and in master mode the CS is held from
+                 the first word to the last. The segments are gathered in
+                 MCSPI_TX_CHUNK blocks, so a word may be split across them
+    @parameters: client: the client sending
+                 from: the packed words, a multiple of the word size in total
+    @return:     bytes sent; error if nothing was sent
+..............................................................................*/
+ssize_t MCSPI_transfer_iter(struct MCSPI_client *client, struct iov_iter *from)
+{
+  struct MCSPI *dev = &client->config;
+  bool master = (dev->role == MCSPI_MODULCTRL_MASTER);
+  bool rx = (dev->tx_rx != MCSPI_CHCONF_TRM_TX);
+  bool turbo = FALSE;
+  size_t len = iov_iter_count(from);
+  size_t done = 0, block;
+  void *buf;
+  int err;
+
+  //the chunk is a multiple of 4 bytes, so every block is whole words
+  buf = kmalloc(min_t(size_t, len, MCSPI_TX_CHUNK), GFP_KERNEL);
+  if(!buf)
+    return -ENOMEM;
+
+  err = MCSPI_bus_lock(client);
+  if(err)
+  {
+    kfree(buf);
+    return err;
+  }
+
+  if(master)
+    turbo = __stream_begin(dev, len / MCSPI_CHCONF_WL_BYTES(dev->word_length));
+
+  while(done < len)
+  {
+    block = min_t(size_t, len - done, MCSPI_TX_CHUNK);
+
+    if(!copy_from_iter_full(buf, block, from))
+    {
+      err = -EFAULT;
+      break;
+    }
+
+    err = MCSPI_send_data(client->data, buf, block);
+    if(err < 0)
+    {
+      DEBUG_ALERT("%s: Writev: failed after %zu bytes (%d)\n", DRIVER_NAME, done, err);
+      break;
+    }
+
+    if(rx)
+      MCSPI_rx_push(client, buf, block);
+    done += block;
+  }
+
+  if(master)
+    __stream_end(dev, turbo);
+
+  MCSPI_bus_unlock(client);
+  kfree(buf);
+
+  return done ? done : err;
+}
+
+
+/*..............................................................................
+    @breif:      Run all the segments of a message in one go under the bus
+                 lock. In master mode the CS is held from the first segment to
+                 the last, except where a segment asks for it to be released.
+                 A segment whose settings differ from the ones in the channel
+                 only gets its CHxCONF changed, the client's settings are put
+                 back after the message
+    @parameters: client: the client sending
+                 seg: the segments
+                 n: number of segments
+    @return:     0 on success; error of the first failed segment otherwise
+..............................................................................*/
+int MCSPI_transfer_message(struct MCSPI_client *client, struct MCSPI_segment *seg, int n)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI cur = client->config;      //what the channel is set up with
+  bool master = (cur.role == MCSPI_MODULCTRL_MASTER);
+  bool changed = FALSE, turbo = FALSE;
+  int i, err, words = 0;
+
+  err = MCSPI_bus_lock(client);
+  if(err)
+    return err;
+
+  for(i = 0 ; i < n ; i++)
+    words += seg[i].len / MCSPI_CHCONF_WL_BYTES(seg[i].word_length);
+
+  data->device = &cur;
+  if(master)
+    turbo = __stream_begin(&cur, words);
+
+  for(i = 0 ; i < n ; i++)
+  {
+    if(seg[i].tx_rx != cur.tx_rx || seg[i].clock_div != cur.clock_div ||
+       seg[i].speed_hz != cur.speed_hz || seg[i].word_length != cur.word_length)
+    {
+      cur.tx_rx = seg[i].tx_rx;
+      cur.clock_div = seg[i].clock_div;
+      cur.speed_hz = seg[i].speed_hz;
+      cur.word_length = seg[i].word_length;
+
+      changed = TRUE;
+      if(MCSPI_configure_channel(&cur))
+      {
+        DEBUG_ALERT("%s: Message: segment %d: configuration failed\n", DRIVER_NAME, i);
+        err = -EIO;
+        break;
+      }
+      MCSPI_enable(&cur, 1);
+    }
+
+    if(seg[i].len)
+    {
+      err = MCSPI_send_data(data, seg[i].buf, seg[i].len);
+      if(err < 0)
+      {
+        DEBUG_ALERT("%s: Message: segment %d failed (%d)\n", DRIVER_NAME, i, err);
+        break;
+      }
+    }
+
+    if(seg[i].delay_usecs > 10)
+      usleep_range(seg[i].delay_usecs, seg[i].delay_usecs + seg[i].delay_usecs/4);
+    else if(seg[i].delay_usecs)
+      udelay(seg[i].delay_usecs);
+
+    if(master && seg[i].cs_change && i < n-1)
+    {
+      MCSPI_cs_force(&cur, 0);
+      MCSPI_cs_force(&cur, 1);
+    }
+  }
+
+  if(master)
+    __stream_end(&cur, turbo);
+
+  //the next message of the client expects its own settings in the channel
+  data->device = &client->config;
+  if(changed)
+  {
+    if(MCSPI_configure_channel(data->device))
+    {
+      //unknown state, the next bus_setup starts over with a reset
+      DEBUG_ALERT("%s: Message: restoring the configuration failed\n", DRIVER_NAME);
+      data->configured = FALSE;
+      data->active = NULL;
+      if(!err)
+        err = -EIO;
+    }
+    else
+      MCSPI_enable(data->device, 1);
+  }
+
+  MCSPI_bus_unlock(client);
+  return err;
+}
+
+
+/*..............................................................................
+    @breif:      Queue the received words for read(). Whatever does not fit in
+                 the ring is dropped and counted in client->rx_overflow
+    @parameters: client: the client the words belong to
+                 msg: the received words
+                 len: the length in bytes
+    @return:     void
+..............................................................................*/
+void MCSPI_rx_push(struct MCSPI_client *client, void* msg, int len)
+{
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+  unsigned int room = kfifo_avail(&client->rx_fifo);
+  unsigned int copied;
+
+  //only whole words go in, so read() never sees half a word
+  copied = kfifo_in(&client->rx_fifo, msg, min_t(unsigned int, len, room - room % wl_bytes));
+  if(copied < len)
+  {
+    client->rx_overflow += len - copied;
+    DEBUG_ALERT("%s: RX: ring full, dropped %u bytes\n", DRIVER_NAME, len - copied);
+  }
+
+  wake_up_interruptible(&client->rx_wait);
+
+  if(!list_empty_careful(&client->aio_reads))
+    queue_work(client->data->wq, &client->aio_work);
+}
+
+
+/*..............................................................................
+    @breif:      Move whole words from the receive ring into an iov_iter. The
+                 words only leave the ring once they are in the buffers
+    @parameters: client: the client reading, holding client->rx_mutex
+                 to: where the words go, a multiple of the word size
+    @return:     bytes copied (0 if the ring is empty); error otherwise
+..............................................................................*/
+ssize_t MCSPI_rx_pull(struct MCSPI_client *client, struct iov_iter *to)
+{
+  struct kfifo *ring = MCSPI_rx_ring(client);
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+  size_t len, copied;
+  void *buf;
+
+  len = min_t(size_t, iov_iter_count(to), kfifo_len(ring));
+  len -= len % wl_bytes;
+  if(!len)
+    return 0;
+
+  buf = kmalloc(len, GFP_KERNEL);
+  if(!buf)
+    return -ENOMEM;
+
+  len = kfifo_out_peek(ring, buf, len);
+  copied = copy_to_iter(buf, len, to);
+  copied -= copied % wl_bytes;
+
+  //take out only what the user got
+  copied = kfifo_out(ring, buf, copied);
+  kfree(buf);
+
+  return copied ? copied : -EFAULT;
+}
+
+
+//frees the request, the kiocb is done with it once completed
+static void __aio_complete(struct MCSPI_aio *aio, long res)
+{
+  struct kiocb *iocb = aio->iocb;
+
+  if(aio->mm)
+    mmput(aio->mm);
+  kfree(aio->iov);
+  kfree(aio->buf);
+  kfree(aio);
+
+  iocb->ki_complete(iocb, res, 0);
+}
+
+
+/*
+Called by the AIO core with its own lock held, so the request can't be
+completed from here; it is only marked and left to MCSPI_aio_work
+*/
+static int MCSPI_aio_cancel(struct kiocb *iocb)
+{
+  struct MCSPI_client *client = iocb->ki_filp->private_data;
+  struct MCSPI_aio *aio;
+  unsigned long flags;
+
+  spin_lock_irqsave(&client->aio_lock, flags);
+  list_for_each_entry(aio, &client->aio_reads, list)
+  {
+    if(aio->iocb == iocb)
+      aio->cancelled = TRUE;
+  }
+  spin_unlock_irqrestore(&client->aio_lock, flags);
+
+  queue_work(client->data->wq, &client->aio_work);
+  return 0;
+}
+
+
+/*
+Whether the kiocb comes from the aio layer, the only one kiocb_set_cancel_fn
+may be used on. Other async callers have no cancel
+*/
+static bool __aio_cancelable(struct kiocb *iocb)
+{
+#ifdef IOCB_AIO_RW
+  return iocb->ki_flags & IOCB_AIO_RW;
+#else
+  return !is_sync_kiocb(iocb);
+#endif
+}
+
+
+/*..............................................................................
+    @breif:      Queue an AIO write. The words are copied in right away and
+                 sent by MCSPI_aio_work like a writev(), the kiocb is completed
+                 with the number of bytes sent or the error
+    @parameters: client: the client writing
+                 iocb: the request, not a sync one
+                 from: the words, a multiple of the word size
+    @return:     -EIOCBQUEUED; error if it couldn't be queued
+..............................................................................*/
+ssize_t MCSPI_aio_write(struct MCSPI_client *client, struct kiocb *iocb, struct iov_iter *from)
+{
+  struct MCSPI_aio *aio;
+
+  aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+  if(!aio)
+    return -ENOMEM;
+
+  //the user buffers can't be reached from the worker, so copy them now
+  aio->len = iov_iter_count(from);
+  aio->buf = kmalloc(aio->len, GFP_KERNEL);
+  if(!aio->buf)
+  {
+    kfree(aio);
+    return -ENOMEM;
+  }
+  if(!copy_from_iter_full(aio->buf, aio->len, from))
+  {
+    kfree(aio->buf);
+    kfree(aio);
+    return -EFAULT;
+  }
+  aio->iocb = iocb;
+
+  spin_lock_irq(&client->aio_lock);
+  list_add_tail(&aio->list, &client->aio_writes);
+  spin_unlock_irq(&client->aio_lock);
 
-  if(timeout == 0)
-    timeout = 1;
+  queue_work(client->data->wq, &client->aio_work);
+  return -EIOCBQUEUED;
+}
 
-  switch(dev->channel_number)
+
+/*..............................................................................
+    @breif:      Queue an AIO read. MCSPI_aio_work completes it once words are
+                 in the receive ring (see MCSPI_rx_push), or with -ECANCELED
+                 if the request is cancelled first (io_submit requests only)
+    @parameters: client: the client reading
+                 iocb: the request, not a sync one
+                 to: the user buffers, a multiple of the word size
+    @return:     -EIOCBQUEUED; error if it couldn't be queued
+..............................................................................*/
+ssize_t MCSPI_aio_read(struct MCSPI_client *client, struct kiocb *iocb, struct iov_iter *to)
+{
+  struct MCSPI_aio *aio;
+
+  aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+  if(!aio)
+    return -ENOMEM;
+
+  //the iter and its segment array belong to the submitter's stack
+  aio->iov = dup_iter(&aio->iter, to, GFP_KERNEL);
+  if(!aio->iov)
   {
-    default:
-    case 0: channel_stat = dev->base_addr + MCSPI_CH0STAT;
-            channel_tx = MCSPI_TX0;
-            channel_rx = MCSPI_RX0;
-            break;
-    case 1: channel_stat = dev->base_addr + MCSPI_CH1STAT;
-            channel_tx = MCSPI_TX1;
-            channel_rx = MCSPI_RX1;
-            break;
-    case 2: channel_stat = dev->base_addr + MCSPI_CH2STAT;
-            channel_tx = MCSPI_TX2;
-            channel_rx = MCSPI_RX2;
-            break;
-    case 3: channel_stat = dev->base_addr + MCSPI_CH3STAT;
-            channel_tx = MCSPI_TX3;
-            channel_rx = MCSPI_RX3;
-            break;
+    kfree(aio);
+    return -ENOMEM;
   }
+  aio->len = iov_iter_count(to);
+  aio->iocb = iocb;
+
+  aio->mm = current->mm;
+  if(aio->mm)
+    mmget(aio->mm);
+
+  //only a kiocb of the aio layer (io_submit) has a place for the callback
+  if(__aio_cancelable(iocb))
+    kiocb_set_cancel_fn(iocb, MCSPI_aio_cancel);
+
+  spin_lock_irq(&client->aio_lock);
+  list_add_tail(&aio->list, &client->aio_reads);
+  spin_unlock_irq(&client->aio_lock);
 
-  DEBUG_NORM("%s: Send: sending %d characters\n", DRIVER_NAME, len);
+  //words may have come in since the caller found the ring empty
+  queue_work(client->data->wq, &client->aio_work);
+  return -EIOCBQUEUED;
+}
+
+
+/*
+Take the next read that can be completed: a cancelled one, or else the oldest
+one if the receive ring has words
+*/
+static struct MCSPI_aio *__aio_next_read(struct MCSPI_client *client)
+{
+  struct MCSPI_aio *aio, *next = NULL;
 
-  for(bytes = 0 ; bytes < len ; bytes++)
+  spin_lock_irq(&client->aio_lock);
+  list_for_each_entry(aio, &client->aio_reads, list)
   {
-    MCSPI_write_reg(dev->base_addr, channel_tx, (u32)msg[bytes]);
-    mb();
+    if(aio->cancelled)
+    {
+      next = aio;
+      break;
+    }
+  }
+  if(!next && !kfifo_is_empty(MCSPI_rx_ring(client)))
+    next = list_first_entry_or_null(&client->aio_reads, struct MCSPI_aio, list);
+  if(next)
+    list_del(&next->list);
+  spin_unlock_irq(&client->aio_lock);
 
-    DEBUG_NORM("Send: sent %c -- \n\n", msg[bytes]);
+  return next;
+}
 
-    if(MCSPI_wait_for_bit_set(channel_stat, MCSPI_CHSTAT_TXS_MASK, timeout) < 0)
-      return -ETIME;
 
+/*..............................................................................
+    @breif:      Work function of the AIO requests. Sends the queued writes in
+                 order, then completes the reads the receive ring has words for
+    @parameters: work: client->aio_work
+    @return:     void
+..............................................................................*/
+void MCSPI_aio_work(struct work_struct *work)
+{
+  struct MCSPI_client *client = container_of(work, struct MCSPI_client, aio_work);
+  struct MCSPI_aio *aio;
+  struct iov_iter iter;
+  struct kvec kv;
+  long res;
+
+  for(;;)
+  {
+    spin_lock_irq(&client->aio_lock);
+    aio = list_first_entry_or_null(&client->aio_writes, struct MCSPI_aio, list);
+    if(aio)
+      list_del(&aio->list);
+    spin_unlock_irq(&client->aio_lock);
+
+    if(!aio)
+      break;
+
+    //one transfer under a single CS, the same as a writev()
+    kv.iov_base = aio->buf;
+    kv.iov_len = aio->len;
+    iov_iter_kvec(&iter, WRITE | ITER_KVEC, &kv, 1, aio->len);
+    __aio_complete(aio, MCSPI_transfer_iter(client, &iter));
+  }
 
-    if(dev->tx_rx == MCSPI_CHCONF_TRM_RX || dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX)
+  //the ring has to keep the words __aio_next_read saw until they are pulled
+  mutex_lock(&client->rx_mutex);
+  while((aio = __aio_next_read(client)))
+  {
+    if(aio->cancelled)
     {
-      if(MCSPI_wait_for_bit_set(channel_stat, MCSPI_CHSTAT_RXS_MASK, timeout) < 0)
-        return -ETIME;
+      __aio_complete(aio, -ECANCELED);
+      continue;
+    }
+
+    if(aio->mm)
+      use_mm(aio->mm);
+    res = MCSPI_rx_pull(client, &aio->iter);
+    if(aio->mm)
+      unuse_mm(aio->mm);
+
+    __aio_complete(aio, res);
+  }
+  mutex_unlock(&client->rx_mutex);
+}
+
+
+
+/*..............................................................................
+    @breif:      Work function of the asynchronous write queue. Sends whatever
+                 write() queued in client->msg.tx_fifo, in MCSPI_TX_CHUNK blocks
+    @parameters: work: client->msg.tx_work
+    @return:     void
+..............................................................................*/
+void MCSPI_tx_work(struct work_struct *work)
+{
+  struct MCSPI_client *client = container_of(work, struct MCSPI_client, msg.tx_work);
+  struct MCSPI_msg *queue = &client->msg;
+  unsigned int len;
+  int err;
+
+  //write() only queues whole words and the chunk is a multiple of 4 bytes,
+  //so every block taken out is whole words as well
+  while((len = kfifo_out(&queue->tx_fifo, queue->msg, queue->buffer_length)) > 0)
+  {
+    //the ring has room again
+    wake_up_interruptible(&queue->tx_wait);
+
+    //each block takes the bus on its own, so other clients get in between
+    err = READ_ONCE(queue->discard) ? -ETIME : MCSPI_transfer(client, queue->msg, len);
+    if(err < 0)
+    {
+      DEBUG_ALERT("%s: Async: Timeout in sending data\n", DRIVER_NAME);
+      if(!queue->error)
+        queue->error = err;
+    }
+
+    if(atomic_sub_return(len, &queue->pending) == 0)
+      wake_up_all(&queue->tx_wait);
+  }
+}
+
+
+/*
+Move words from the RX FIFO of the capturing channel into the ring: a chunk
+(RX_FULL says it is there), or with until_empty whatever the FIFO holds. Words
+the ring has no room for are still read out, so the FIFO keeps going, and
+counted as dropped. The caller holds cap->lock: the IRQ handler and
+MCSPI_capture_poll both fill the ring.
+*/
+static void __capture_drain(struct MCSPI_capture *cap, struct MCSPI *dev, bool until_empty)
+{
+  int ch = dev->channel_number;
+  u32 words[2*MCSPI_FIFO_DEPTH / sizeof(u32)];   //RX alone gets the whole FIFO
+  int max = until_empty ? sizeof(words) / cap->wl_bytes : cap->chunk;
+  unsigned int room;
+  int n;
+
+  for(n = 0 ; n < max ; n++)
+  {
+    if(until_empty &&
+       (MCSPI_read_reg(dev->base_addr, MCSPI_CHSTAT(ch)) & MCSPI_CHSTAT_RXFFE_MASK))
+      break;
+    __put_word(words, n, cap->wl_bytes, MCSPI_read_reg(dev->base_addr, MCSPI_RX(ch)));
+  }
+
+  room = kfifo_avail(cap->ring) / cap->wl_bytes;
+
+  cap->words += n;
+  if(cap->frame_words)
+    cap->frames = div_u64(cap->words, cap->frame_words);
+  if(n > room)
+  {
+    cap->dropped += n - room;
+    n = room;
+  }
+
+  kfifo_in(cap->ring, words, n * cap->wl_bytes);
+}
+
+
+/*..............................................................................
+    @breif:      Start a slave capture: the channel of the client becomes
+                 receive only and the IRQ handler drains its RX FIFO into
+                 client->capture_fifo, which read() and poll() then use. No
+                 other transfer gets the module until MCSPI_capture_stop
+    @parameters: client: the client, in slave mode and holding the bus lock
+                 frame_words: words per frame (counted from the words
+                 received), 0 for none
+    @return:     0 on success; -EINVAL if not in slave mode or frame_words is
+                 too big; -ENODEV without the IRQ; -ENOMEM
+..............................................................................*/
+int MCSPI_capture_start(struct MCSPI_client *client, u32 frame_words)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI_capture *cap = &data->capture;
+  struct MCSPI *dev = &client->config;
+  int ch = dev->channel_number;
+  unsigned long flags;
 
-      msg[bytes] = MCSPI_read_reg(dev->base_addr, channel_rx);
+  if(dev->role != MCSPI_MODULCTRL_SLAVE || frame_words > MCSPI_XFER_WCNT_MAX)
+    return -EINVAL;
+  if(!data->irq)
+    return -ENODEV;
+
+  if(!client->capture_buf)
+  {
+    client->capture_buf = vmalloc(MCSPI_CAPTURE_RING_SIZE);
+    if(!client->capture_buf)
+      return -ENOMEM;
+    if(kfifo_init(&client->capture_fifo, client->capture_buf, MCSPI_CAPTURE_RING_SIZE))
+    {
+      vfree(client->capture_buf);
+      client->capture_buf = NULL;
+      return -ENOMEM;
     }
   }
+  //a reader may still be draining the last capture
+  mutex_lock(&client->rx_mutex);
+  kfifo_reset(&client->capture_fifo);
+  mutex_unlock(&client->rx_mutex);
 
-  if(MCSPI_wait_for_bit_set(channel_stat, MCSPI_CHSTAT_EOT_MASK, timeout) < 0)
-    return -ETIME;
+  spin_lock_irqsave(&cap->lock, flags);
+  cap->words = 0;
+  cap->dropped = 0;
+  cap->frames = 0;
+  cap->fifo_overflows = 0;
+  spin_unlock_irqrestore(&cap->lock, flags);
+
+  cap->ring = &client->capture_fifo;
+  cap->wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  cap->chunk = MCSPI_FIFO_CHUNK / cap->wl_bytes;
+  cap->frame_words = frame_words;
+  cap->irq_enabled = MCSPI_IRQ_RX_FULL_MASK(ch);
+  if(ch == 0)
+    cap->irq_enabled |= MCSPI_IRQ_RX0_OVERFLOW_MASK;
+
+  MCSPI_enable(dev, 0);
+  MCSPI_slave_fifo_set(dev, 1, MCSPI_CHCONF_TRM_RX);
+  //no WCNT: the channel has to stay enabled for the whole capture, the word
+  //count would only start over after a disable and the master doesn't wait
+  MCSPI_write_reg(dev->base_addr, MCSPI_XFERLEVEL,
+                  MCSPI_XFERLEVEL_AFL(MCSPI_FIFO_CHUNK - 1));
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, MCSPI_IRQ_RESET);
+
+  //the clock has to stay on after the bus lock is given back
+  pm_runtime_get_noresume(&data->pdev->dev);
+
+  cap->client = client;
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQENABLE, cap->irq_enabled);
+  MCSPI_enable(dev, 1);
+
+  DEBUG_NORM("%s: Capture: started on ch %d, %u words a frame\n", DRIVER_NAME, ch, frame_words);
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Stop the slave capture of the client. What is left in the FIFO
+                 goes into the ring, the channel gets its own settings back.
+                 The ring can still be read after this
+    @parameters: client: the client
+    @return:     0; -EINVAL if the client is not capturing
+..............................................................................*/
+int MCSPI_capture_stop(struct MCSPI_client *client)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI_capture *cap = &data->capture;
+  struct MCSPI *dev = &client->config;
+  unsigned long flags;
+
+  mutex_lock(&data->bus_lock);
+  if(cap->client != client)
+  {
+    mutex_unlock(&data->bus_lock);
+    return -EINVAL;
+  }
+
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQENABLE, 0);
+  synchronize_irq(data->irq);
+
+  //the words of an unfinished chunk are still in the FIFO
+  spin_lock_irqsave(&cap->lock, flags);
+  __capture_drain(cap, dev, TRUE);
+  cap->irq_enabled = 0;
+  cap->client = NULL;
+  spin_unlock_irqrestore(&cap->lock, flags);
+
+  MCSPI_enable(dev, 0);
+  MCSPI_slave_fifo_set(dev, 0, MCSPI_CHCONF_TRM_RX);
+  MCSPI_fifo_levels_set(dev);
+  MCSPI_enable(dev, 1);
+
+  pm_runtime_mark_last_busy(&data->pdev->dev);
+  pm_runtime_put_autosuspend(&data->pdev->dev);
+  mutex_unlock(&data->bus_lock);
+
+  wake_up_interruptible(&client->rx_wait);
+
+  DEBUG_NORM("%s: Capture: stopped, %llu words, %llu dropped\n", DRIVER_NAME, cap->words, cap->dropped);
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      The IRQ handler while a slave capture runs (see
+                 MCSPI_irq_handler). Moves a chunk per RX_FULL into the ring
+    @parameters: data: the driver data
+    @return:     whether irq was handled or not
+..............................................................................*/
+irq_handler_t MCSPI_capture_irq(struct MCSPI_data *data)
+{
+  struct MCSPI_capture *cap = &data->capture;
+  struct MCSPI_client *client = cap->client;
+  struct MCSPI *dev = &client->config;
+  u32 val;
+
+  val = MCSPI_read_reg(dev->base_addr, MCSPI_IRQSTATUS) & cap->irq_enabled;
+  if(!val)
+    return (irq_handler_t) IRQ_NONE;
+
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, val);
+
+  if(val & MCSPI_IRQ_RX0_OVERFLOW_MASK)
+  {
+    spin_lock(&cap->lock);
+    cap->fifo_overflows++;
+    spin_unlock(&cap->lock);
+  }
+
+  if(val & MCSPI_IRQ_RX_FULL_MASK(dev->channel_number))
+  {
+    spin_lock(&cap->lock);
+    __capture_drain(cap, dev, FALSE);
+    spin_unlock(&cap->lock);
+  }
 
+  wake_up_interruptible(&client->rx_wait);
+  if(!list_empty_careful(&client->aio_reads))
+    queue_work(data->wq, &client->aio_work);
+
+  return (irq_handler_t) IRQ_HANDLED;
+}
+
+
+/*..............................................................................
+    @breif:      Take what the FIFO of a running capture holds into the ring.
+                 Less than a chunk (the end of a frame, or of the data) never
+                 raises RX_FULL, readers pick it up with this
+    @parameters: client: the client
+    @return:     void
+..............................................................................*/
+void MCSPI_capture_poll(struct MCSPI_client *client)
+{
+  struct MCSPI_capture *cap = &client->data->capture;
+  unsigned long flags;
+
+  spin_lock_irqsave(&cap->lock, flags);
+  if(cap->client == client)
+    __capture_drain(cap, &client->config, TRUE);
+  spin_unlock_irqrestore(&cap->lock, flags);
+}
+
+
+/*
+Make buf[cur] the response the FIFO is fed from, from its first word on
+*/
+static void __response_load(struct MCSPI_response *resp)
+{
+  resp->words = resp->len[resp->cur] / resp->wl_bytes;
+  resp->tx_count = 0;
+}
+
+
+/*
+Put the next max words of the response stream into the TX FIFO. The responses
+follow each other without a gap, the channel is never stopped: after the last
+word of one comes the staged response, or the same one again. Returns whether
+a staged response was taken. Called with resp->lock held.
+*/
+static bool __response_fill(struct MCSPI_response *resp, struct MCSPI *dev, int max)
+{
+  bool taken = FALSE;
+  int i;
+
+  for(i = 0 ; i < max ; i++, resp->tx_count++)
+  {
+    if(resp->tx_count == resp->words)
+    {
+      resp->transactions++;
+      if(resp->staged)
+      {
+        resp->cur = !resp->cur;
+        resp->staged = FALSE;
+        taken = TRUE;
+      }
+      else
+        resp->repeats++;
+      __response_load(resp);
+    }
+    MCSPI_write_reg(dev->base_addr, MCSPI_TX(dev->channel_number),
+                    __get_word(resp->buf[resp->cur], resp->tx_count, resp->wl_bytes));
+  }
+  return taken;
+}
+
+
+/*..............................................................................
+    @breif:      Stage the next slave response of the client. It is sent in
+                 the first transaction that starts after the current one ends
+                 (or by MCSPI_response_start); until then the response before
+                 is sent again in every transaction
+    @parameters: client: the client
+                 buf: the packed words, from user space
+                 len: bytes, a multiple of the word size, at most
+                      MCSPI_RESPONSE_MAX
+    @return:     0 on success; -EAGAIN if one is staged already; -EINVAL,
+                 -EFAULT, -ENOMEM otherwise
+..............................................................................*/
+int MCSPI_response_stage(struct MCSPI_client *client, const void __user *buf, int len)
+{
+  struct MCSPI_response *resp = &client->resp;
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+  unsigned long flags;
+  int i, err = 0;
+
+  if(len <= 0 || len > MCSPI_RESPONSE_MAX || len % wl_bytes)
+    return -EINVAL;
+
+  for(i = 0 ; i < 2 ; i++)
+  {
+    if(!resp->buf[i])
+      resp->buf[i] = kmalloc(MCSPI_RESPONSE_MAX, GFP_KERNEL);
+    if(!resp->buf[i])
+      return -ENOMEM;
+  }
+
+  //the producer lock of the file, one stager at a time
+  if(mutex_lock_interruptible(&client->msg.msg_mutex))
+    return -ERESTARTSYS;
+
+  //buf[!cur] is only touched by the IRQ handler once it is staged, and cur
+  //does not change before that
+  if(resp->staged)
+    err = -EAGAIN;
+  else if(copy_from_user(resp->buf[!resp->cur], buf, len))
+    err = -EFAULT;
+  else
+  {
+    spin_lock_irqsave(&resp->lock, flags);
+    resp->len[!resp->cur] = len;
+    resp->staged = TRUE;
+    spin_unlock_irqrestore(&resp->lock, flags);
+  }
+
+  mutex_unlock(&client->msg.msg_mutex);
+  return err;
+}
+
+
+/*..............................................................................
+    @breif:      Start the slave response mode: the channel of the client
+                 becomes transmit only, the staged response is loaded into the
+                 TX FIFO and the IRQ handler keeps it fed, one transaction per
+                 response. No other transfer gets the module until
+                 MCSPI_response_stop
+    @parameters: client: the client, in slave mode and holding the bus lock
+    @return:     0 on success; -EINVAL if not in slave mode; -ENODATA if no
+                 response is staged; -ENODEV without the IRQ
+..............................................................................*/
+int MCSPI_response_start(struct MCSPI_client *client)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI_response *resp = &client->resp;
+  struct MCSPI *dev = &client->config;
+  int ch = dev->channel_number;
+  unsigned long flags;
+
+  if(dev->role != MCSPI_MODULCTRL_SLAVE)
+    return -EINVAL;
+  if(!data->irq)
+    return -ENODEV;
+  if(!resp->staged)
+    return -ENODATA;
+
+  resp->wl_bytes = MCSPI_CHCONF_WL_BYTES(dev->word_length);
+  resp->chunk = MCSPI_FIFO_CHUNK / resp->wl_bytes;
+
+  //the word length may have changed since it was staged
+  if(resp->len[!resp->cur] % resp->wl_bytes)
+    return -EINVAL;
+
+  spin_lock_irqsave(&resp->lock, flags);
+  resp->cur = !resp->cur;
+  resp->staged = FALSE;
+  resp->transactions = 0;
+  resp->repeats = 0;
+  resp->underflows = 0;
+  spin_unlock_irqrestore(&resp->lock, flags);
+
+  resp->irq_enabled = MCSPI_IRQ_TX_EMPTY_MASK(ch);
+  if(ch == 0)
+    resp->irq_enabled |= MCSPI_IRQ_TX0_UNDERFLOW_MASK;
+
+  //no WCNT: the word count would only start over after a disable, and the
+  //master doesn't wait for that. TX_EMPTY keeps the FIFO topped up instead
+  MCSPI_enable(dev, 0);
+  MCSPI_slave_fifo_set(dev, 1, MCSPI_CHCONF_TRM_TX);
+  MCSPI_write_reg(dev->base_addr, MCSPI_XFERLEVEL, MCSPI_XFERLEVEL_AEL(MCSPI_FIFO_CHUNK - 1));
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, MCSPI_IRQ_RESET);
+  MCSPI_enable(dev, 1);
+
+  //TX alone gets the whole FIFO, it is full before the master starts clocking
+  spin_lock_irqsave(&resp->lock, flags);
+  __response_load(resp);
+  __response_fill(resp, dev, 2*MCSPI_FIFO_DEPTH / resp->wl_bytes);
+  spin_unlock_irqrestore(&resp->lock, flags);
+
+  //the clock has to stay on after the bus lock is given back
+  pm_runtime_get_noresume(&data->pdev->dev);
+
+  data->responder = client;
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQENABLE, resp->irq_enabled);
+
+  //the buffer staged before is free again
+  wake_up_interruptible(&client->msg.tx_wait);
+
+  DEBUG_NORM("%s: Response: started on ch %d, %d words\n", DRIVER_NAME, ch, resp->words);
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      Leave the slave response mode, the channel gets its own
+                 settings back. The staged response (if any) is kept
+    @parameters: client: the client
+    @return:     0; -EINVAL if the client is not in the response mode
+..............................................................................*/
+int MCSPI_response_stop(struct MCSPI_client *client)
+{
+  struct MCSPI_data *data = client->data;
+  struct MCSPI *dev = &client->config;
+
+  mutex_lock(&data->bus_lock);
+  if(data->responder != client)
+  {
+    mutex_unlock(&data->bus_lock);
+    return -EINVAL;
+  }
+
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQENABLE, 0);
+  synchronize_irq(data->irq);
+  client->resp.irq_enabled = 0;
+  data->responder = NULL;
+
+  MCSPI_enable(dev, 0);
+  MCSPI_slave_fifo_set(dev, 0, MCSPI_CHCONF_TRM_TX);
+  MCSPI_fifo_levels_set(dev);
+  MCSPI_enable(dev, 1);
+
+  pm_runtime_mark_last_busy(&data->pdev->dev);
+  pm_runtime_put_autosuspend(&data->pdev->dev);
+  mutex_unlock(&data->bus_lock);
+
+  DEBUG_NORM("%s: Response: stopped after %u transactions\n", DRIVER_NAME, client->resp.transactions);
   return 0;
 }
 
 
+/*..............................................................................
+    @breif:      The IRQ handler in the slave response mode (see
+                 MCSPI_irq_handler). Tops the TX FIFO up with the response
+                 stream on TX_EMPTY, swapping in the staged response after the
+                 end of the current one
+    @parameters: data: the driver data
+    @return:     whether irq was handled or not
+..............................................................................*/
+irq_handler_t MCSPI_response_irq(struct MCSPI_data *data)
+{
+  struct MCSPI_client *client = data->responder;
+  struct MCSPI_response *resp = &client->resp;
+  struct MCSPI *dev = &client->config;
+  bool taken = FALSE;
+  u32 val;
+
+  val = MCSPI_read_reg(dev->base_addr, MCSPI_IRQSTATUS) & resp->irq_enabled;
+  if(!val)
+    return (irq_handler_t) IRQ_NONE;
+
+  MCSPI_write_reg(dev->base_addr, MCSPI_IRQSTATUS, val);
+
+  spin_lock(&resp->lock);
+
+  if(val & MCSPI_IRQ_TX0_UNDERFLOW_MASK)
+    resp->underflows++;
+
+  if(val & MCSPI_IRQ_TX_EMPTY_MASK(dev->channel_number))
+    taken = __response_fill(resp, dev, resp->chunk);
+
+  spin_unlock(&resp->lock);
+
+  //a new response can be staged
+  if(taken)
+    wake_up_interruptible(&client->msg.tx_wait);
+
+  return (irq_handler_t) IRQ_HANDLED;
+}
+
+
+/*..............................................................................
+    @breif:      Waits until everything queued by asynchronous writes of the
+                 client is on the wire. The wait can be interrupted by a signal
+    @parameters: client: the client
+    @return:     0, or the error of the first transfer that failed since the
+                 last flush; -ERESTARTSYS if a signal came first
+..............................................................................*/
+int MCSPI_flush(struct MCSPI_client *client)
+{
+  struct MCSPI_msg *queue = &client->msg;
+  int err;
+
+  if(wait_event_interruptible(queue->tx_wait, atomic_read(&queue->pending) == 0))
+    return -ERESTARTSYS;
+
+  err = queue->error;
+  queue->error = 0;
+  return err;
+}
+
+
+/*..............................................................................
+    @breif:      MCSPI_flush for release: waits at most timeout_ms, after that
+                 the rest of the queue is dropped instead of sent (a slave
+                 whose master stopped clocking would never drain it)
+    @parameters: client: the client
+                 timeout_ms: how long to wait for the queue to drain
+    @return:     0; -ETIME if the rest of the queue was dropped
+..............................................................................*/
+int MCSPI_flush_timeout(struct MCSPI_client *client, unsigned int timeout_ms)
+{
+  struct MCSPI_msg *queue = &client->msg;
+
+  if(wait_event_timeout(queue->tx_wait, atomic_read(&queue->pending) == 0,
+                        msecs_to_jiffies(timeout_ms)))
+    return 0;
+
+  //tx_work finishes the block it is on and throws the rest away
+  queue->discard = TRUE;
+  DEBUG_ALERT("%s: Async: %d bytes still queued, dropped\n", DRIVER_NAME, atomic_read(&queue->pending));
+  return -ETIME;
+}
+
 
 /*..............................................................................
     @breif:      Configure the whole module with settings
@@ -100,7 +1683,8 @@ int MCSPI_configure(struct MCSPI *mcspi)
 {
   MCSPI_reset(mcspi);
 
-  //MCSPI_set_bit(mcspi->base_addr+MCSPI_CH0CONF, (0x03UL<<19));
+  //FORCE/TURBO are not part of the configuration, they are set for a
+  //message at a time (see __stream_begin)
 
   if(mcspi->role == MCSPI_MODULCTRL_MASTER || mcspi->role == MCSPI_MODULCTRL_SLAVE)
     MCSPI_mode_set(mcspi);
@@ -110,6 +1694,15 @@ int MCSPI_configure(struct MCSPI *mcspi)
     return CONFIGURE_FAIL;
   }
 
+  return MCSPI_configure_channel(mcspi);
+}
+
+
+//fills in the shadow of CHxCONF, MCSPI_configure_channel writes it out
+static int __configure_channel(struct MCSPI *mcspi)
+{
+  MCSPI_trm_set(mcspi);
+
   if(mcspi->clock_div >= CLK_1   &&  mcspi->clock_div <= CLK_32768)
     MCSPI_Set_CLKD(mcspi);
   else
@@ -127,7 +1720,14 @@ int MCSPI_configure(struct MCSPI *mcspi)
   if(mcspi->CS_polarity == MCSPI_CS_ACTIVE_LOW || mcspi->CS_polarity == MCSPI_CS_ACTIVE_HIGH)
     MCSPI_Set_CS(mcspi);
 
-  if(mcspi->channel_number>=0 && mcspi->channel_number<=4)
+  if(mcspi->xfer_mode == MCSPI_XFER_MODE_POLL || mcspi->xfer_mode == MCSPI_XFER_MODE_FIFO ||
+     mcspi->xfer_mode == MCSPI_XFER_MODE_IRQ  || mcspi->xfer_mode == MCSPI_XFER_MODE_DMA ||
+     mcspi->xfer_mode == MCSPI_XFER_MODE_BULK)
+    MCSPI_fifo_set(mcspi, mcspi->xfer_mode != MCSPI_XFER_MODE_POLL);
+  else
+    DEBUG_ALERT("%s: Config: wrong transfer mode\n", DRIVER_NAME);
+
+  if(mcspi->channel_number>=0 && mcspi->channel_number<MCSPI_NUM_CHANNELS)
   {
     if(mcspi->pin_direction == MCSPI_D0_IN_D1_OUT || mcspi->pin_direction == MCSPI_D1_IN_D0_OUT)
     {
@@ -161,3 +1761,42 @@ int MCSPI_configure(struct MCSPI *mcspi)
     return CONFIGURE_FAIL;
   }
 }
+
+
+/*..............................................................................
+    @breif:      Configure only the channel of mcspi (its CHxCONF), without the
+                 reset. Only the registers with a changed field are written,
+                 once each, from the shadows; the channel is switched off for
+                 that and left off (MCSPI_enable it again). If nothing changed
+                 the channel is not touched. On a failure nothing is written,
+                 but the shadows are off: the module has to be reset (marked
+                 unconfigured) before it is used again
+    @parameters: mcspi: struct containing all the parameters to be passed on
+    @return:     CONFIGURE_SUCCESS/CONFIGURE_FAIL
+..............................................................................*/
+int MCSPI_configure_channel(struct MCSPI *mcspi)
+{
+  int err;
+
+  //the channel picks the shadow, so it is checked before anything is set
+  if(mcspi->channel_number < 0 || mcspi->channel_number >= MCSPI_NUM_CHANNELS)
+  {
+    DEBUG_ALERT("%s: Config: Incorrect channel number (0-3)\n", DRIVER_NAME);
+    return CONFIGURE_FAIL;
+  }
+
+  err = __configure_channel(mcspi);
+  if(err)
+    return err;
+
+  //IRQ and DMA program the levels (and the word count) for every transfer,
+  //FIFO needs them put back after those
+  if(mcspi->regs->dirty || mcspi->xfer_mode == MCSPI_XFER_MODE_FIFO)
+  {
+    MCSPI_enable(mcspi, 0);
+    MCSPI_regs_flush(mcspi);
+    if(mcspi->xfer_mode == MCSPI_XFER_MODE_FIFO)
+      MCSPI_fifo_levels_set(mcspi);
+  }
+  return err;
+}
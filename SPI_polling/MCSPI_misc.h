@@ -18,13 +18,39 @@
 #include <linux/uaccess.h>        // Required for the copy to user function
 #include <linux/ioport.h>         // Required for request_mem_region
 #include <asm/io.h> 		          // Required for ioremap/ unmap etc.
+#include <linux/completion.h>     // Required for the interrupt driven transfers
+#include <linux/kfifo.h>          // Required for the receive ring
+#include <linux/wait.h>
+#include <linux/workqueue.h>      // Required for the asynchronous writes
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/cdev.h>           // Required for the per controller char devices
+#include <linux/platform_device.h>
+#include <linux/delay.h>          // Required for the delays between segments
+#include <linux/uio.h>            // Required for the iov_iter of readv/writev
+#include <linux/aio.h>            // Required for the cancel of queued AIO reads
+#include <linux/mmu_context.h>    // Required for use_mm in the AIO worker
+#include <linux/sched/mm.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/vmalloc.h>        // Required for the capture ring
 
 #include "MCSPI_reg.h"
+#include "MCSPI_dma.h"
 #include "control_module.h"
 
 #define CONFIGURE_SUCCESS         0
 #define CONFIGURE_FAIL            1
 #define MAX_BUFFER_LENGTH         50
+#define MCSPI_RX_RING_SIZE        4096      //bytes, must be a power of 2
+#define MCSPI_TX_RING_SIZE        16384     //bytes, must be a power of 2
+#define MCSPI_TX_CHUNK            4096      //largest transfer tx_work does at once
+#define MCSPI_MSG_MAX             (64*1024) //bytes of all segments of a message
+#define MCSPI_RELEASE_FLUSH_MS    5000      //close() waits this long for the async queue
+#define MCSPI_MAP_MAX             (1024*1024) //bytes of the mmap() buffer of a file
+#define MCSPI_CAPTURE_RING_SIZE   (1024*1024) //bytes, must be a power of 2
+#define MCSPI_CAPTURE_POLL_MS     10          //a waiting reader looks at the FIFO this often
+#define MCSPI_RESPONSE_MAX        4096      //bytes of a staged slave response
 
 #ifndef TRUE
 #define TRUE                      1
@@ -57,20 +83,461 @@
 
 
 
+//Asynchronous write queue. write() is the only producer (msg_mutex keeps it
+//that way) and tx_work the only consumer, so the kfifo needs no other lock
 struct MCSPI_msg{
-  char *msg;
-  int buffer_length;
-  spinlock_t msg_spinlock;
+  char *msg;                  //bounce buffer tx_work sends from
+  int buffer_length;          //size of msg
+  struct kfifo tx_fifo;       //words queued by write(), not yet sent
+  atomic_t pending;           //bytes queued or being sent
+  int error;                  //first failed transfer since the last flush
+  bool discard;               //release gave up waiting, drop what is left
+  struct work_struct tx_work;
+  wait_queue_head_t tx_wait;  //woken when room frees up/the queue drains
   struct mutex msg_mutex;
 };
 
+//One asynchronous read/write (AIO kiocb) waiting for MCSPI_aio_work
+struct MCSPI_aio{
+  struct list_head list;
+  struct kiocb *iocb;
+  void *buf;                  //write: the words, copied in at submission
+  size_t len;                 //bytes
+  struct iov_iter iter;       //read: the user segments, see dup_iter
+  const void *iov;            //read: the segment array the iter points to
+  struct mm_struct *mm;       //read: the submitter's, the worker copies into it
+  bool cancelled;             //read: io_cancel/io_destroy asked for it
+};
+
+//State of the transfer the IRQ handler is working on (MCSPI_XFER_MODE_IRQ)
+struct MCSPI_xfer{
+  void *buf;                  //packed words, overwritten with RX data in TX_RX
+  int words;                  //words in this transfer (at most 65535, WCNT)
+  int wl_bytes;               //bytes per word in buf
+  int chunk;                  //words moved per FIFO event
+  int tx_count;
+  int rx_count;
+  bool rx;                    //TX_RX: also read back the received words
+  unsigned int eot_us;        //bound on the wait for EOT after EOW
+  u32 irq_enabled;            //copy of MCSPI_IRQENABLE, saves a read per IRQ
+  int status;
+  struct completion done;
+};
+
+//Slave capture (MCSPI_CAPTURE_START): the IRQ handler drains the RX FIFO of
+//the channel into the capture ring of the client until MCSPI_CAPTURE_STOP
+struct MCSPI_capture{
+  struct MCSPI_client *client; //NULL if no capture is running
+  struct kfifo *ring;
+  int wl_bytes;
+  int chunk;                  //words per RX_FULL event
+  u32 frame_words;            //words per frame; 0 for no frames
+  u32 irq_enabled;
+  spinlock_t lock;            //the FIFO drain and the counters
+  u64 words;                  //words taken out of the FIFO
+  u64 dropped;                //of those, lost because the ring was full
+  u32 frames;                 //words / frame_words
+  u32 fifo_overflows;         //RX FIFO overflows, words lost in the module
+};
+
+//Slave responses (MCSPI_RESPONSE_x) of a client: the buffer the IRQ handler
+//feeds the TX FIFO from and the one the next response is staged in. They swap
+//once the last word of the current response is in the FIFO, if a new response
+//was staged
+struct MCSPI_response{
+  void *buf[2];               //MCSPI_RESPONSE_MAX bytes each, NULL until staged
+  int len[2];                 //bytes
+  int cur;                    //buffer being sent
+  bool staged;                //buf[!cur] holds the next response
+  int words;                  //words of buf[cur], the length of a transaction
+  int tx_count;               //words of buf[cur] put in the FIFO
+  int wl_bytes;
+  int chunk;                  //words per TX_EMPTY event
+  u32 irq_enabled;
+  spinlock_t lock;            //staged/cur and the counters
+  u32 transactions;           //responses put into the FIFO in full
+  u32 repeats;                //of those, followed by the same one again
+  u32 underflows;             //TX FIFO underflows (channel 0 only)
+};
+
+//pad of the control module and the mux mode which gives it to the MCSPI
+struct MCSPI_pin{
+  u32 offset;
+  u32 mode;
+};
+
+#define MCSPI_NUM_PINS            5         //SCLK, D0, D1, CS0, CS1
+
+//What differs between MCSPI0 and MCSPI1, passed to probe with the platform
+//device. The registers and the IRQ come as its resources
+struct MCSPI_platform_data{
+  int bus_num;                //the X of /dev/MCSPIX.<channel>
+  u32 clkctrl;                //CM_PER_SPI(0/1)_CLKCTRL
+  struct MCSPI_pin pins[MCSPI_NUM_PINS];
+};
+
+//One per controller (platform device). Nothing in here is shared with the
+//other controller, so the two run in parallel
 struct MCSPI_data {
-  dev_t  device_id;
+  dev_t  device_id;           //first of the MCSPI_NUM_CHANNELS numbers
+  struct cdev cdev;
+  struct platform_device *pdev;
+  const struct MCSPI_platform_data *pdata;
+  struct workqueue_struct *wq;//runs the asynchronous writes
+  struct mutex open_lock;     //protects numberOpens
   int numberOpens;
-  struct MCSPI *device;
-  struct MCSPI_msg *msg;
+  int irq;                    //0 if the IRQ could not be requested
+  void __iomem *base_addr;    //mapped at probe, shared by the clients
+  void __iomem *clock_base;   //CM_PER, for the runtime PM clock gating
+  struct MCSPI_regs regs;     //shadows of the configuration registers
+  struct MCSPI *device;       //settings of the client holding the bus
+  struct MCSPI_client *active;//client the module is configured for, or NULL
+  int channel;                //channel of the last client which had the bus
+  bool configured;            //module wide settings below are programmed
+  unsigned int role;
+  unsigned int CS_sensitive;
+  struct mutex bus_lock;      //held for a whole message
+  struct MCSPI_xfer xfer;
+  struct MCSPI_dma dma;
+  struct MCSPI_capture capture;
+  struct MCSPI_client *responder;//client in the slave response mode, or NULL
+};
+
+//A set of settings registered with MCSPI_PROFILE_SET, checked once and with
+//the register words worked out, so switching to it is a couple of writes
+struct MCSPI_profile{
+  bool valid;
+  struct MCSPI config;
+  u32 modulctrl;
+  u32 chconf;                 //CHxCONF of the channel of the client
+};
+
+//One per open(). Every client has its own settings and queues; the module
+//is reconfigured for whichever of them takes the bus
+struct MCSPI_client {
+  struct MCSPI_data *data;
+  struct MCSPI config;
+  struct MCSPI_profile profiles[MCSPI_NUM_PROFILES];
+  struct MCSPI_msg msg;
+  struct kfifo rx_fifo;       //words received in RX/TX_RX, drained by read()
+  wait_queue_head_t rx_wait;
+  struct mutex rx_mutex;      //the one consumer of rx_fifo and capture_fifo
+  unsigned int rx_overflow;   //bytes dropped because the ring was full
+  struct list_head aio_writes; //MCSPI_aio queued by write_iter, in order
+  struct list_head aio_reads; //MCSPI_aio waiting for the receive ring
+  spinlock_t aio_lock;        //protects both lists, taken in the AIO cancel
+  struct work_struct aio_work;
+  struct kfifo capture_fifo;  //filled by a slave capture, drained by read()
+  void *capture_buf;          //its memory, NULL until the first capture
+  struct MCSPI_response resp;
+  void *map_buf;              //the mmap()ed TX/RX buffer, NULL until mmap()
+  unsigned long map_size;
 };
 
+/*..............................................................................
+    @breif:      Take the bus for a message of the client. If the module was
+                 last used by another client it is configured for this one
+    @parameters: client: the client which wants the bus
+    @return:     0 on success, with data->bus_lock held; -EBUSY if the module
+                 couldn't be configured or a slave capture/response mode has
+                 it (the lock is not held then)
+..............................................................................*/
+int MCSPI_bus_lock(struct MCSPI_client *client);
+void MCSPI_bus_unlock(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      Configure the module for the client if no client has it yet
+                 (first open, after a failed configuration or a resume), so
+                 e.g. the idle level of the CS is right before any message
+    @parameters: client: the client
+    @return:     void
+..............................................................................*/
+void MCSPI_bus_claim_idle(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      Configure the module for the client. Only the fields which
+                 differ are written; the module is reset only when it isn't
+                 configured yet (first open, or after a failed configuration)
+    @parameters: client: the client, with data->bus_lock held
+    @return:     CONFIGURE_SUCCESS/CONFIGURE_FAIL
+..............................................................................*/
+int MCSPI_bus_setup(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      Check the settings of a profile and work out its MODULCTRL and
+                 CHxCONF words, without touching the hardware
+    @parameters: client: the client, with data->bus_lock held
+                 index: the profile (0 to MCSPI_NUM_PROFILES-1)
+                 config: the settings, for the channel of the client
+    @return:     0 on success; -EINVAL if the settings are not valid
+..............................................................................*/
+int MCSPI_profile_set(struct MCSPI_client *client, unsigned int index, const struct MCSPI *config);
+
+/*..............................................................................
+    @breif:      Make a registered profile the settings of the client and load
+                 its precomputed words into the module
+    @parameters: client: the client, with data->bus_lock held
+                 index: the profile (0 to MCSPI_NUM_PROFILES-1)
+    @return:     0 on success; -EINVAL if there's no such profile; -EBUSY if
+                 the module couldn't be configured
+..............................................................................*/
+int MCSPI_profile_activate(struct MCSPI_client *client, unsigned int index);
+
+/*..............................................................................
+    @breif:      Send one message of the client, the caller holds the bus lock.
+                 In the streaming mode (master) the CS is held for the whole
+                 message, with TURBO if it is long
+    @parameters: client: the client sending
+                 msg: the packed words, overwritten with the received data
+                 len: the length in bytes
+    @return:     0 on success; error otherwise
+..............................................................................*/
+int MCSPI_send_stream(struct MCSPI_client *client, void* msg, int len);
+
+/*..............................................................................
+    @breif:      Send one message of the client under the bus lock and queue
+                 what was received for read() (MCSPI_send_stream)
+    @parameters: client: the client sending
+                 msg: the packed words, overwritten with the received data
+                 len: the length in bytes
+    @return:     0 on success; error otherwise
+..............................................................................*/
+int MCSPI_transfer(struct MCSPI_client *client, void* msg, int len);
+
+/*..............................................................................
+    @breif:      Send all the segments of an iov_iter (writev) as one transfer:
+                 the bus is taken once and in master mode the CS is held from
+                 the first word to the last. The segments are gathered in
+                 MCSPI_TX_CHUNK blocks, so a word may be split across them
+    @parameters: client: the client sending
+                 from: the packed words, a multiple of the word size in total
+    @return:     bytes sent; error if nothing was sent
+..............................................................................*/
+ssize_t MCSPI_transfer_iter(struct MCSPI_client *client, struct iov_iter *from);
+
+//One segment of an MCSPI_IOC_MESSAGE, copied into the kernel and with the
+//settings resolved (no MCSPI_XFER_KEEP left)
+struct MCSPI_segment{
+  void *buf;                  //packed words, overwritten with the received ones
+  unsigned int len;           //bytes, at most MCSPI_MSG_MAX
+  unsigned int tx_rx;         //MCSPI_CHCONF_TRM_TX or MCSPI_CHCONF_TRM_TX_RX
+  unsigned int clock_div;
+  unsigned int speed_hz;      //0: clock_div (see struct MCSPI)
+  unsigned int word_length;
+  unsigned int delay_usecs;   //wait after the segment
+  bool cs_change;             //release the CS after the segment, never the last
+};
+
+/*..............................................................................
+    @breif:      Run all the segments of a message in one go under the bus
+                 lock. In master mode the CS is held from the first segment to
+                 the last, except where a segment asks for it to be released.
+                 A segment whose settings differ from the ones in the channel
+                 only gets its CHxCONF changed, the client's settings are put
+                 back after the message
+    @parameters: client: the client sending
+                 seg: the segments
+                 n: number of segments
+    @return:     0 on success; error of the first failed segment otherwise
+..............................................................................*/
+int MCSPI_transfer_message(struct MCSPI_client *client, struct MCSPI_segment *seg, int n);
+
+/*..............................................................................
+    @breif:      Queue the received words for read(). Whatever does not fit in
+                 the ring is dropped and counted in client->rx_overflow
+    @parameters: client: the client the words belong to
+                 msg: the received words
+                 len: the length in bytes
+    @return:     void
+..............................................................................*/
+void MCSPI_rx_push(struct MCSPI_client *client, void* msg, int len);
+
+/*..............................................................................
+    @breif:      Work function of the asynchronous write queue. Sends whatever
+                 write() queued in client->msg.tx_fifo, in MCSPI_TX_CHUNK blocks
+    @parameters: work: client->msg.tx_work
+    @return:     void
+..............................................................................*/
+void MCSPI_tx_work(struct work_struct *work);
+
+
+/*..............................................................................
+    @breif:      Move whole words from the receive ring into an iov_iter. The
+                 words only leave the ring once they are in the buffers
+    @parameters: client: the client reading, holding client->rx_mutex
+                 to: where the words go, a multiple of the word size
+    @return:     bytes copied (0 if the ring is empty); error otherwise
+..............................................................................*/
+ssize_t MCSPI_rx_pull(struct MCSPI_client *client, struct iov_iter *to);
+
+/*..............................................................................
+    @breif:      Queue an AIO write. The words are copied in right away and
+                 sent by MCSPI_aio_work like a writev(), the kiocb is completed
+                 with the number of bytes sent or the error
+    @parameters: client: the client writing
+                 iocb: the request, not a sync one
+                 from: the words, a multiple of the word size
+    @return:     -EIOCBQUEUED; error if it couldn't be queued
+..............................................................................*/
+ssize_t MCSPI_aio_write(struct MCSPI_client *client, struct kiocb *iocb, struct iov_iter *from);
+
+/*..............................................................................
+    @breif:      Queue an AIO read. MCSPI_aio_work completes it once words are
+                 in the receive ring (see MCSPI_rx_push), or with -ECANCELED
+                 if the request is cancelled first (io_submit requests only)
+    @parameters: client: the client reading
+                 iocb: the request, not a sync one
+                 to: the user buffers, a multiple of the word size
+    @return:     -EIOCBQUEUED; error if it couldn't be queued
+..............................................................................*/
+ssize_t MCSPI_aio_read(struct MCSPI_client *client, struct kiocb *iocb, struct iov_iter *to);
+
+/*..............................................................................
+    @breif:      Work function of the AIO requests. Sends the queued writes in
+                 order, then completes the reads the receive ring has words for
+    @parameters: work: client->aio_work
+    @return:     void
+..............................................................................*/
+void MCSPI_aio_work(struct work_struct *work);
+
+/*..............................................................................
+    @breif:      Start a slave capture: the channel of the client becomes
+                 receive only and the IRQ handler drains its RX FIFO into
+                 client->capture_fifo, which read() and poll() then use. No
+                 other transfer gets the module until MCSPI_capture_stop
+    @parameters: client: the client, in slave mode and holding the bus lock
+                 frame_words: words per frame (counted from the words
+                 received), 0 for none
+    @return:     0 on success; -EINVAL if not in slave mode or frame_words is
+                 too big; -ENODEV without the IRQ; -ENOMEM
+..............................................................................*/
+int MCSPI_capture_start(struct MCSPI_client *client, u32 frame_words);
+
+/*..............................................................................
+    @breif:      Stop the slave capture of the client. What is left in the FIFO
+                 goes into the ring, the channel gets its own settings back.
+                 The ring can still be read after this
+    @parameters: client: the client
+    @return:     0; -EINVAL if the client is not capturing
+..............................................................................*/
+int MCSPI_capture_stop(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      The IRQ handler while a slave capture runs (see
+                 MCSPI_irq_handler). Moves a chunk per RX_FULL into the ring
+    @parameters: data: the driver data
+    @return:     whether irq was handled or not
+..............................................................................*/
+irq_handler_t MCSPI_capture_irq(struct MCSPI_data *data);
+
+/*..............................................................................
+    @breif:      Take what the FIFO of a running capture holds into the ring.
+                 Less than a chunk (the end of a frame, or of the data) never
+                 raises RX_FULL, readers pick it up with this
+    @parameters: client: the client
+    @return:     void
+..............................................................................*/
+void MCSPI_capture_poll(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      Stage the next slave response of the client. It is sent in
+                 the first transaction that starts after the current one ends
+                 (or by MCSPI_response_start); until then the response before
+                 is sent again in every transaction
+    @parameters: client: the client
+                 buf: the packed words, from user space
+                 len: bytes, a multiple of the word size, at most
+                      MCSPI_RESPONSE_MAX
+    @return:     0 on success; -EAGAIN if one is staged already; -EINVAL,
+                 -EFAULT, -ENOMEM otherwise
+..............................................................................*/
+int MCSPI_response_stage(struct MCSPI_client *client, const void __user *buf, int len);
+
+/*..............................................................................
+    @breif:      Start the slave response mode: the channel of the client
+                 becomes transmit only, the staged response is loaded into the
+                 TX FIFO and the IRQ handler keeps it fed, one transaction per
+                 response. No other transfer gets the module until
+                 MCSPI_response_stop
+    @parameters: client: the client, in slave mode and holding the bus lock
+    @return:     0 on success; -EINVAL if not in slave mode; -ENODATA if no
+                 response is staged; -ENODEV without the IRQ
+..............................................................................*/
+int MCSPI_response_start(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      Leave the slave response mode, the channel gets its own
+                 settings back. The staged response (if any) is kept
+    @parameters: client: the client
+    @return:     0; -EINVAL if the client is not in the response mode
+..............................................................................*/
+int MCSPI_response_stop(struct MCSPI_client *client);
+
+/*..............................................................................
+    @breif:      The IRQ handler in the slave response mode (see
+                 MCSPI_irq_handler). Tops the TX FIFO up with the response
+                 stream on TX_EMPTY, swapping in the staged response after the
+                 end of the current one
+    @parameters: data: the driver data
+    @return:     whether irq was handled or not
+..............................................................................*/
+irq_handler_t MCSPI_response_irq(struct MCSPI_data *data);
+
+//the ring read() and poll() work on: the capture ring while the client
+//captures and until it is drained after that, the receive ring otherwise
+static inline struct kfifo *MCSPI_rx_ring(struct MCSPI_client *client)
+{
+  if(client->capture_buf &&
+     (client->data->capture.client == client || !kfifo_is_empty(&client->capture_fifo)))
+    return &client->capture_fifo;
+  return &client->rx_fifo;
+}
+
+/*..............................................................................
+    @breif:      Waits until everything queued by asynchronous writes of the
+                 client is on the wire. The wait can be interrupted by a signal
+    @parameters: client: the client
+    @return:     0, or the error of the first transfer that failed since the
+                 last flush; -ERESTARTSYS if a signal came first
+..............................................................................*/
+int MCSPI_flush(struct MCSPI_client *client);
+
+
+/*..............................................................................
+    @breif:      MCSPI_flush for release: waits at most timeout_ms, after that
+                 the rest of the queue is dropped instead of sent (a slave
+                 whose master stopped clocking would never drain it)
+    @parameters: client: the client
+                 timeout_ms: how long to wait for the queue to drain
+    @return:     0; -ETIME if the rest of the queue was dropped
+..............................................................................*/
+int MCSPI_flush_timeout(struct MCSPI_client *client, unsigned int timeout_ms);
+
+/*
+Fetch/store word i of a packed buffer of bytes-wide words. The buffers passed
+to the send functions are word aligned (kmalloc), so a plain access is fine.
+*/
+static inline u32 __get_word(const void *buf, int i, int bytes)
+{
+  switch(bytes)
+  {
+    case 4:  return ((const u32 *)buf)[i];
+    case 2:  return ((const u16 *)buf)[i];
+    default: return ((const u8 *)buf)[i];
+  }
+}
+
+static inline void __put_word(void *buf, int i, int bytes, u32 val)
+{
+  switch(bytes)
+  {
+    case 4:  ((u32 *)buf)[i] = val;       break;
+    case 2:  ((u16 *)buf)[i] = (u16)val;  break;
+    default: ((u8 *)buf)[i] = (u8)val;    break;
+  }
+}
+
+
 /*..............................................................................
     @breif:      Configure the whole module with settings
     @parameters: mcspi: struct containing all the parameters to be passed on
@@ -78,6 +545,29 @@ struct MCSPI_data {
 ..............................................................................*/
 int MCSPI_configure(struct MCSPI *mcspi);
 
-int MCSPI_send_data_poll(struct MCSPI *dev, char* msg, int len);
+/*..............................................................................
+    @breif:      Configure only the channel of mcspi (CHxCONF), no reset
+    @parameters: mcspi: struct containing all the parameters to be passed on
+    @return:     CONFIGURE_SUCCESS/CONFIGURE_FAIL
+..............................................................................*/
+int MCSPI_configure_channel(struct MCSPI *mcspi);
+
+/*..............................................................................
+    @breif:      Send the data one word at a time (poll), through the FIFO (fifo),
+                 through the FIFO with the word count programmed (bulk), from
+                 the IRQ handler (irq) or with whichever of them (or the DMA,
+                 see MCSPI_dma.h) data->device->xfer_mode selects. The caller
+                 holds the bus lock
+    @parameters: dev/data: struct defining device
+                 msg: the message as packed words of the configured word
+                      length, overwritten with the received data in TX_RX
+                 len: the length of the message in bytes
+    @return:     0 on success; -ETIME on timeout
+..............................................................................*/
+int MCSPI_send_data_poll(struct MCSPI *dev, void* msg, int len);
+int MCSPI_send_data_fifo(struct MCSPI *dev, void* msg, int len);
+int MCSPI_send_data_bulk(struct MCSPI *dev, void* msg, int len);
+int MCSPI_send_data_irq(struct MCSPI_data *data, void* msg, int len);
+int MCSPI_send_data(struct MCSPI_data *data, void* msg, int len);
 
 #endif
@@ -17,34 +17,44 @@
 #include <linux/platform_device.h>// Required for platform_device functions
 #include <linux/of_device.h>
 #include <linux/device.h>
+#include <linux/cdev.h>
+#include <linux/mm.h>             // Required for the mmap() of the transfer buffer
+#include <linux/vmalloc.h>        // Required for vmalloc_user/remap_vmalloc_range
+#include <linux/poll.h>           // Required for poll/select/epoll
 
 #include "MCSPI_reg.h"
 #include "MCSPI_misc.h"
 #include "mcspi_ioctl.h"
 
-#define  DEVICE_NAME "MCSPI"              ///< The device will appear at /dev/ebbchar using this value
+#define  DEVICE_NAME "MCSPI"              ///< The devices will appear at /dev/MCSPI<bus>.<channel> using this value
 #define  CLASS_NAME  "SPI_Driver_Class"   ///< The device class -- this is a character device driver
-#define  MAJOR_NUMBER 0
+#define  MCSPI_NUM_BUSES 2                ///< MCSPI0 and MCSPI1
 
 MODULE_LICENSE      ("GPL v2");                           ///< The license type -- this affects available functionality
 MODULE_AUTHOR       ("Aniruddha Kanhere");              ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION  ("A MCSPI LKM for the BBB");  ///< The description -- see modinfo
 MODULE_VERSION      ("1.0");                           ///< A version number to inform users
 
-static int    majorNumber;                  ///< Stores the device number -- determined automatically
-static char   message[256] = {0};           ///< Memory for the string that is passed from userspace
-static short  size_of_message;              ///< Used to remember the size of the string stored
+static dev_t  MCSPI_devt;                   ///< First device number, MCSPI_NUM_CHANNELS per bus from here
 static struct class*  MCSPI_Class  = NULL; ///< The device-driver class struct pointer
-static struct device* MCSPI_Device = NULL; ///< The device-driver device struct pointer
-static DEFINE_MUTEX(MCSPI_mutex);
-struct resource *res;
+static struct platform_device *MCSPI_pdev[MCSPI_NUM_BUSES]; ///< The two controllers
+
+static int autosuspend_ms = 2000;
+module_param(autosuspend_ms, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time (ms) before the clock of a controller is gated, can be changed later in power/autosuspend_delay_ms");
 
 // The prototype functions for the character driver -- must come before the struct definition
 static int     MCSPI_open(struct inode *, struct file *);
 static int     MCSPI_release(struct inode *, struct file *);
 static ssize_t MCSPI_read(struct file *, char *, size_t, loff_t *);
 static ssize_t MCSPI_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t MCSPI_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t MCSPI_write_iter(struct kiocb *, struct iov_iter *);
 static long    MCSPI_ioctl(struct file *, unsigned int, unsigned long);
+static int     MCSPI_fsync(struct file *, loff_t, loff_t, int);
+static int     MCSPI_mmap(struct file *, struct vm_area_struct *);
+static __poll_t MCSPI_poll(struct file *, struct poll_table_struct *);
+static long    __MCSPI_ioctl(struct MCSPI_client *, unsigned int, unsigned long);
 
 
 /*  All Devices are represented as file structure in the kernel.
@@ -59,18 +69,22 @@ static struct file_operations fops =
    .open           = MCSPI_open,
    .read           = MCSPI_read,
    .write          = MCSPI_write,
+   .read_iter      = MCSPI_read_iter,    //readv()
+   .write_iter     = MCSPI_write_iter,   //writev(), one transfer for all segments
    .release        = MCSPI_release,
    .unlocked_ioctl = MCSPI_ioctl,        //Instead of the normal ioctl with BKL
+   .fsync          = MCSPI_fsync,        //waits for the asynchronous writes
+   .mmap           = MCSPI_mmap,         //buffer for MCSPI_IOC_XFER_MAPPED
+   .poll           = MCSPI_poll,
 };
 
 
 /*.............................................................................
-These are default values. If the user decides then these values can be changed
-using the ioctl commands. These were in place so that one may directly use the
-driver.
-NOTE: IOCTL function is yet to defined...
+These are default values. Every open() starts with a copy of them, which can
+then be changed using the ioctl commands. These were in place so that one may
+directly use the driver.
 .............................................................................*/
-struct MCSPI mcspi = {
+static const struct MCSPI mcspi_defaults = {
   .base_addr      = NULL,
   .tx_rx          = MCSPI_CHCONF_TRM_TX,
   .channel_number = 0,
@@ -79,13 +93,58 @@ struct MCSPI mcspi = {
   .phase          = MCSPI_CHCONF_PHA_ODD,
   .polarity       = MCSPI_CHCONF_POL_ACTIVE_HIGH,
   .clock_div      = CLK_2,
+  .speed_hz       = 0,
   .pin_direction  = MCSPI_D0_IN_D1_OUT,
   .CS_polarity    = MCSPI_CS_ACTIVE_LOW,
   .CS_sensitive   = MCSPI_CS_SENSITIVE_ENABLED,
+  .xfer_mode      = MCSPI_XFER_MODE_POLL,
+  .async          = 0,
+  .stream         = 0,
 };
 
-struct MCSPI_data data_var;
-struct MCSPI_data *data = &data_var;
+
+/*.............................................................................
+The two controllers of the AM335x, with the pins the BBB has them on. There is
+no device tree node for this driver (the ones for the McSPIs belong to
+spi-omap2-mcspi), so the platform devices are registered by MCSPI_init.
+.............................................................................*/
+static const struct MCSPI_platform_data MCSPI_pdata[MCSPI_NUM_BUSES] = {
+  {
+    .bus_num = 0,
+    .clkctrl = CM_PER_SPI0_CLKCTRL,
+    .pins    = {
+      { CONF_SPI0_SCLK_OFFSET, 0 },
+      { CONF_SPI0_D0_OFFSET,   0 },
+      { CONF_SPI0_D1_OFFSET,   0 },
+      { CONF_SPI0_CS0_OFFSET,  0 },
+      { CONF_SPI0_CS1_OFFSET,  0 },
+    },
+  },
+  {
+    .bus_num = 1,
+    .clkctrl = CM_PER_SPI1_CLKCTRL,
+    .pins    = {
+      { CONF_MCASP0_ACLKX_OFFSET,      3 },
+      { CONF_MCASP0_FSX_OFFSET,        3 },
+      { CONF_MCASP0_AXR0_OFFSET,       3 },
+      { CONF_MCASP0_AHCLKR_OFFSET,     3 },
+      { CONF_ECAP0_IN_PWM0_OUT_OFFSET, 2 },
+    },
+  },
+};
+
+//the IRQ is the line number on the interrupt controller, MCSPI_init swaps it
+//for the Linux IRQ it is mapped to (see MCSPI_irq_map)
+static const struct resource MCSPI_resources[MCSPI_NUM_BUSES][2] = {
+  {
+    DEFINE_RES_MEM(MCSPI0_START, MCSPI0_ADDR_SIZE),
+    DEFINE_RES_IRQ(MCSPI0_IRQ),
+  },
+  {
+    DEFINE_RES_MEM(MCSPI1_START, MCSPI1_ADDR_SIZE),
+    DEFINE_RES_IRQ(MCSPI1_IRQ),
+  },
+};
 
 
 /*..............................................................................
@@ -93,13 +152,14 @@ struct MCSPI_data *data = &data_var;
 *           peripheral connected to the pin. This function should be called in
 *           either open or init functions i.e. before transmitting data or else
 *           one might not get the desired output at all.
-*   @params: void
+*   @params: pdata: the pins of the controller and their mux modes
 *   @return: 0/error
 ..............................................................................*/
-int MCSPI_mux_mode_set(void)
+int MCSPI_mux_mode_set(const struct MCSPI_platform_data *pdata)
 {
   void __iomem *control_module_base;
   u32 val;
+  int pin;
   control_module_base = (void __iomem *)ioremap(CONTROL_MODULE_START, CONTROL_MODULE_SIZE);
   if(IS_ERR(control_module_base))
   {
@@ -107,90 +167,388 @@ int MCSPI_mux_mode_set(void)
     return -(PTR_ERR(control_module_base));
   }
 
-  val = MCSPI_read_reg(control_module_base, CONF_SPI0_SCLK_OFFSET);
-  val &= ~CONF_MODULE_PIN_MMODE(0x07);
-  MCSPI_write_reg(control_module_base, CONF_SPI0_SCLK_OFFSET, val);
+  for(pin = 0 ; pin < MCSPI_NUM_PINS ; pin++)
+  {
+    val = MCSPI_read_reg(control_module_base, pdata->pins[pin].offset);
+    val &= ~CONF_MODULE_PIN_MMODE(0x07);
+    val |= CONF_MODULE_PIN_MMODE(pdata->pins[pin].mode);
+    MCSPI_write_reg(control_module_base, pdata->pins[pin].offset, val);
+  }
 
-  val = MCSPI_read_reg(control_module_base, CONF_SPI0_D0_OFFSET);
-  val &= ~CONF_MODULE_PIN_MMODE(0x07);
-  MCSPI_write_reg(control_module_base, CONF_SPI0_D0_OFFSET, val);
+  iounmap(control_module_base);
+  return 0;
+}
 
-  val = MCSPI_read_reg(control_module_base, CONF_SPI0_D1_OFFSET);
-  val &= ~CONF_MODULE_PIN_MMODE(0x07);
-  MCSPI_write_reg(control_module_base, CONF_SPI0_D1_OFFSET, val);
+//this should be called before using any kind of registers of SPI module.
+//CM_PER is mapped once by MCSPI_hw_start, the runtime PM gates the clock often
+static void clock_start_stop(struct MCSPI_data *data, bool st_sp)
+{
+  if(st_sp)
+    enable_clock(data->clock_base, data->pdata->clkctrl);
+  else
+    disable_clock(data->clock_base, data->pdata->clkctrl);
+}
 
-  val = MCSPI_read_reg(control_module_base, CONF_SPI0_CS0_OFFSET);
-  val &= ~CONF_MODULE_PIN_MMODE(0x07);
-  MCSPI_write_reg(control_module_base, CONF_SPI0_CS0_OFFSET, val);
 
-  val = MCSPI_read_reg(control_module_base, CONF_SPI0_CS1_OFFSET);
-  val &= ~CONF_MODULE_PIN_MMODE(0x07);
-  MCSPI_write_reg(control_module_base, CONF_SPI0_CS1_OFFSET, val);
+/*..............................................................................
+*    @brief Runtime PM: gates the clock of an idle controller (after the
+*           autosuspend delay, power/autosuspend_delay_ms in sysfs)
+*    @params: dev: the device of the platform device
+*    @return: 0
+ .............................................................................*/
+static int MCSPI_runtime_suspend(struct device *dev)
+{
+  struct MCSPI_data *data = dev_get_drvdata(dev);
 
-  iounmap(control_module_base);
+  MCSPI_write_reg(data->base_addr, MCSPI_CHCTRL(data->channel), MCSPI_CHCTRL_EN(0));
+  clock_start_stop(data, 0);
+
+  DEBUG_NORM("%s%d: PM: suspended\n", DEVICE_NAME, data->pdata->bus_num);
+  return 0;
+}
+
+
+/*..............................................................................
+*    @brief Runtime PM: switches the clock back on and puts the register
+*           context back from the shadows. The channel is enabled again by the
+*           next MCSPI_bus_setup
+*    @params: dev: the device of the platform device
+*    @return: 0
+ .............................................................................*/
+static int MCSPI_runtime_resume(struct device *dev)
+{
+  struct MCSPI_data *data = dev_get_drvdata(dev);
+
+  clock_start_stop(data, 1);
+
+  MCSPI_write_reg(data->base_addr, MCSPI_IRQENABLE, 0);
+  if(data->configured)
+    MCSPI_regs_restore(data->base_addr, &data->regs);
+  data->active = NULL;
+
+  DEBUG_NORM("%s%d: PM: resumed\n", DEVICE_NAME, data->pdata->bus_num);
+  return 0;
+}
+
+
+static const struct dev_pm_ops MCSPI_pm_ops = {
+  .runtime_suspend = MCSPI_runtime_suspend,
+  .runtime_resume = MCSPI_runtime_resume,
+};
+
+
+/*..............................................................................
+*    @brief Switches the controller on at probe, it stays on until remove so
+*           that open and close don't have to touch the hardware
+*           - Sets up the clock for the MCSPI module
+*           - maps the physical registers to the virtual kernel space
+*           - Sets the mux mode
+*           - Requests the IRQ
+*    @params: data: the controller
+*    @return: if any error occurs, the returns error or else 0
+ .............................................................................*/
+static int MCSPI_hw_start(struct MCSPI_data *data)
+{
+  struct resource *mem = platform_get_resource(data->pdev, IORESOURCE_MEM, 0);
+  struct device *dev = &data->pdev->dev;
+  int err;
+
+  //enable the clock and check for errors.
+  data->clock_base = (void __iomem *)ioremap(CM_PER_START, CM_PER_SIZE);
+  if(!data->clock_base)
+  {
+    DEBUG_ALERT("%s: Probe: Cannot get access to SPI clock region. Aborting.. \n", DEVICE_NAME);
+    return -ENOMEM;
+  }
+  clock_start_stop(data, 1);
+
+
+  //claims the register space as well, busy while spi-omap2-mcspi holds it
+  data->base_addr = devm_ioremap_resource(dev, mem);
+  if(IS_ERR(data->base_addr))
+  {
+    err = PTR_ERR(data->base_addr);
+    DEBUG_ALERT("%s%d: Probe: Couldn't map the registers (%d)\n", DEVICE_NAME, data->pdata->bus_num, err);
+    data->base_addr = NULL;
+    clock_start_stop(data, 0);
+    iounmap(data->clock_base);
+    data->clock_base = NULL;
+    return err;
+  }
+
+  DEBUG_NORM("%s: Probe: IO mem remap successful(0x%08lx)\n ", DEVICE_NAME, (unsigned long)data->base_addr);
+
+  MCSPI_mux_mode_set(data->pdata);
+
+  //without the IRQ the interrupt driven mode just falls back to polling
+  MCSPI_write_reg(data->base_addr, MCSPI_IRQENABLE, 0);
+  data->irq = platform_get_irq(data->pdev, 0);
+  if(data->irq <= 0 ||
+     request_irq(data->irq, (irq_handler_t) MCSPI_irq_handler, 0, dev_name(&data->pdev->dev), data) < 0)
+  {
+    DEBUG_ALERT("%s%d: Probe: Couldn't get IRQ %d, polling only\n", DEVICE_NAME, data->pdata->bus_num, data->irq);
+    data->irq = 0;
+  }
+
+  //nobody is configured for yet
+  data->active = NULL;
+  data->configured = FALSE;
+  data->channel = 0;
+
+  //the clock stays on while the bus is busy and is gated after it has been
+  //idle for autosuspend_ms, see MCSPI_bus_lock/MCSPI_bus_unlock
+  pm_runtime_set_autosuspend_delay(dev, autosuspend_ms);
+  pm_runtime_use_autosuspend(dev);
+  pm_runtime_get_noresume(dev);
+  pm_runtime_set_active(dev);
+  pm_runtime_enable(dev);
+  pm_runtime_mark_last_busy(dev);
+  pm_runtime_put_autosuspend(dev);
   return 0;
 }
 
-//this should be called before using any kind of registers of SPI module
-int clock_start_stop(bool st_sp)
+//undoes MCSPI_hw_start when the controller goes away
+static void MCSPI_hw_stop(struct MCSPI_data *data)
 {
-  void __iomem *clock_base_addr;
-  clock_base_addr = (void __iomem *)ioremap(CM_PER_START, CM_PER_SIZE);
-  if(IS_ERR(clock_base_addr))
+  struct device *dev = &data->pdev->dev;
+
+  //back on (if it was suspended) for good
+  pm_runtime_get_sync(dev);
+  pm_runtime_disable(dev);
+  pm_runtime_dont_use_autosuspend(dev);
+  pm_runtime_put_noidle(dev);
+
+  //the clock goes off below, so only the channel is switched off
+  MCSPI_write_reg(data->base_addr, MCSPI_CHCTRL(data->channel), MCSPI_CHCTRL_EN(0));
+  MCSPI_write_reg(data->base_addr, MCSPI_IRQENABLE, 0);
+  if(data->irq)
+    free_irq(data->irq, data);
+
+  //the mapping and the region go with the device (devm)
+  data->base_addr = NULL;
+  data->active = NULL;
+
+  //stop the clock to the MCSPI module
+  clock_start_stop(data, 0);
+  iounmap(data->clock_base);
+  data->clock_base = NULL;
+}
+
+
+/*..............................................................................
+*    @brief Sets up one controller: its state, the asynchronous write queue, the
+*           hardware (clock, registers, pins, IRQ), the DMA and the
+*           /dev/MCSPI<bus>.0-3 nodes
+*    @params: pdev: the platform device of the controller
+*    @return returns 0 if successful
+ .............................................................................*/
+static int MCSPI_probe(struct platform_device *pdev)
+{
+  const struct MCSPI_platform_data *pdata = dev_get_platdata(&pdev->dev);
+  struct MCSPI_data *data;
+  struct resource *mem;
+  int ch, err;
+
+  mem = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+  if(!pdata || !mem)
+    return -ENODEV;
+
+  data = devm_kzalloc(&pdev->dev, sizeof(*data), GFP_KERNEL);
+  if(!data)
+    return -ENOMEM;
+
+  data->pdev = pdev;
+  data->pdata = pdata;
+  platform_set_drvdata(pdev, data);         //for the runtime PM callbacks
+  data->device_id = MKDEV(MAJOR(MCSPI_devt), MINOR(MCSPI_devt) + pdata->bus_num * MCSPI_NUM_CHANNELS);
+
+  mutex_init(&data->open_lock);
+  mutex_init(&data->bus_lock);
+  init_completion(&data->xfer.done);
+  spin_lock_init(&data->capture.lock);
+
+  data->wq = alloc_ordered_workqueue("MCSPI%d_tx", WQ_HIGHPRI, pdata->bus_num);
+  if(!data->wq)
+    return -ENOMEM;
+
+  err = MCSPI_hw_start(data);
+  if(err < 0)
   {
-    DEBUG_ALERT("%s: Open: Cannot get access to SPI clock region. Aborting.. \n", DEVICE_NAME);
-    return -(PTR_ERR(clock_base_addr));
+    destroy_workqueue(data->wq);
+    return err;
   }
 
-  if(st_sp)
-    enable_clock(clock_base_addr, CM_PER_SPI0_CLKCTRL);
-  else
-    disable_clock(clock_base_addr, CM_PER_SPI0_CLKCTRL);
+  cdev_init(&data->cdev, &fops);
+  data->cdev.owner = THIS_MODULE;
+  err = cdev_add(&data->cdev, data->device_id, MCSPI_NUM_CHANNELS);
+  if(err)
+  {
+    MCSPI_hw_stop(data);
+    destroy_workqueue(data->wq);
+    DEBUG_ALERT("%s%d: failed to add the char device\n", DEVICE_NAME, pdata->bus_num);
+    return err;
+  }
 
-  iounmap(clock_base_addr);
+  // Register the device driver, one node per chip select. The minor number is the channel
+  for(ch = 0 ; ch < MCSPI_NUM_CHANNELS ; ch++)
+  {
+    struct device *dev = device_create(MCSPI_Class, &pdev->dev, data->device_id + ch, data,
+                                       DEVICE_NAME "%d.%d", pdata->bus_num, ch);
+    if (IS_ERR(dev)){               // Clean up if there is an error
+      err = PTR_ERR(dev);
+      while(ch--)
+        device_destroy(MCSPI_Class, data->device_id + ch);
+      cdev_del(&data->cdev);
+      MCSPI_hw_stop(data);
+      destroy_workqueue(data->wq);
+      DEBUG_ALERT("%s%d: Failed to create the device\n", DEVICE_NAME, pdata->bus_num);
+      return err;
+    }
+  }
+
+  //no DMA just means no MCSPI_XFER_MODE_DMA
+  MCSPI_dma_init(data, mem->start);
+
+  DEBUG_NORM("%s%d: device class created correctly\n", DEVICE_NAME, pdata->bus_num); // Made it! device was initialized
   return 0;
 }
 
 
+//undoes MCSPI_probe. Every file is closed by now (the fops hold the module)
+static int MCSPI_remove(struct platform_device *pdev)
+{
+  struct MCSPI_data *data = platform_get_drvdata(pdev);
+  int ch;
+
+  MCSPI_dma_release(data);
+  for(ch = 0 ; ch < MCSPI_NUM_CHANNELS ; ch++)
+    device_destroy(MCSPI_Class, data->device_id + ch);  // remove the devices
+  cdev_del(&data->cdev);
+  MCSPI_hw_stop(data);
+  destroy_workqueue(data->wq);
+  mutex_destroy(&data->bus_lock);
+  mutex_destroy(&data->open_lock);
+  return 0;
+}
+
+
+static struct platform_driver MCSPI_driver = {
+  .driver = {
+    .name = DEVICE_NAME,
+    .owner = THIS_MODULE,
+    .pm = &MCSPI_pm_ops,
+  },
+  .probe = MCSPI_probe,
+  .remove = MCSPI_remove,
+};
+
+
 /*..............................................................................
-*    @brief The LKM initialization function
+*    @brief Maps the interrupt controller line of a McSPI to a Linux IRQ. The
+*           DT node of the McSPI (there for spi-omap2-mcspi, found by its
+*           address) has it in the terms of its interrupt controller; with no
+*           such node the line is mapped through the domain of the INTC
+*    @params: start: physical address of the McSPI registers
+*             hwirq: the line on the INTC (MCSPIx_IRQ)
+*    @return the Linux IRQ, 0 if there is none
+ .............................................................................*/
+static unsigned int __init MCSPI_irq_map(resource_size_t start, u32 hwirq)
+{
+  struct irq_fwspec fwspec = {0};
+  struct device_node *np;
+  unsigned int virq;
+
+  np = MCSPI_of_node(start);
+  if(np)
+  {
+    virq = irq_of_parse_and_map(np, 0);
+    of_node_put(np);
+    return virq;
+  }
+
+  np = of_find_compatible_node(NULL, NULL, "ti,am33xx-intc");
+  if(!np)
+    return 0;
+
+  fwspec.fwnode = of_node_to_fwnode(np);
+  fwspec.param_count = 1;
+  fwspec.param[0] = hwirq;
+  virq = irq_create_fwspec_mapping(&fwspec);
+  of_node_put(np);
+  return virq;
+}
+
+
+/*..............................................................................
+*    @brief The LKM initialization function. Registers the platform driver and
+*           a platform device for each of MCSPI0 and MCSPI1
 *    @params: void
 *    @return returns 0 if successful
  .............................................................................*/
 static int __init MCSPI_init(void){
+   int bus, err;
 
    DEBUG_ALERT("%s: Initializing... \n", DEVICE_NAME);
 
-   // Try to dynamically allocate a major number for the device -- more difficult but worth it
-   majorNumber = register_chrdev(MAJOR_NUMBER, DEVICE_NAME, &fops);
-   if (majorNumber<0){
+   // Dynamically allocate the device numbers, MCSPI_NUM_CHANNELS for each bus
+   err = alloc_chrdev_region(&MCSPI_devt, 0, MCSPI_NUM_BUSES * MCSPI_NUM_CHANNELS, DEVICE_NAME);
+   if (err<0){
       DEBUG_ALERT("%s: failed to register a major number\n", DEVICE_NAME);
-      return majorNumber;
+      return err;
    }
 
-   DEBUG_NORM("%s: Registered correctly with major number %d\n" ,DEVICE_NAME, majorNumber);
+   DEBUG_NORM("%s: Registered correctly with major number %d\n" ,DEVICE_NAME, MAJOR(MCSPI_devt));
 
    // Register the device class
    MCSPI_Class = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(MCSPI_Class)){                // Check for error and clean up if there is
-      unregister_chrdev(majorNumber, DEVICE_NAME);
+      unregister_chrdev_region(MCSPI_devt, MCSPI_NUM_BUSES * MCSPI_NUM_CHANNELS);
       DEBUG_ALERT("%s: Failed to register device class\n", DEVICE_NAME);
       return PTR_ERR(MCSPI_Class);          // Correct way to return an error on a pointer
    }
 
    DEBUG_NORM("%s: device class registered correctly\n", DEVICE_NAME);
 
-   // Register the device driver
-   MCSPI_Device = device_create(MCSPI_Class, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-   if (IS_ERR(MCSPI_Device)){               // Clean up if there is an error
-      class_destroy(MCSPI_Class);           // Repeated code but the alternative is goto statements
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      DEBUG_ALERT("%s: Failed to create the device\n", DEVICE_NAME);
-      return PTR_ERR(MCSPI_Device);
+   err = platform_driver_register(&MCSPI_driver);
+   if (err){
+      class_destroy(MCSPI_Class);
+      unregister_chrdev_region(MCSPI_devt, MCSPI_NUM_BUSES * MCSPI_NUM_CHANNELS);
+      DEBUG_ALERT("%s: Failed to register the platform driver\n", DEVICE_NAME);
+      return err;
+   }
+
+   //probe runs for each of them as they are added
+   for(bus = 0 ; bus < MCSPI_NUM_BUSES ; bus++)
+   {
+      struct resource res[ARRAY_SIZE(MCSPI_resources[bus])];
+      unsigned int virq;
+
+      //without a mapping the device gets no IRQ and probe falls back to polling
+      memcpy(res, MCSPI_resources[bus], sizeof(res));
+      virq = MCSPI_irq_map(res[0].start, res[1].start);
+      if(virq)
+      {
+         res[1].start = virq;
+         res[1].end = virq;
+      }
+      else
+         DEBUG_ALERT("%s: No Linux IRQ for MCSPI%d (INTC line %u)\n", DEVICE_NAME, bus, (unsigned int)res[1].start);
+
+      MCSPI_pdev[bus] = platform_device_register_resndata(NULL, DEVICE_NAME, bus,
+                                                          res, virq ? ARRAY_SIZE(res) : 1,
+                                                          &MCSPI_pdata[bus], sizeof(MCSPI_pdata[bus]));
+      if (IS_ERR(MCSPI_pdev[bus])){
+         err = PTR_ERR(MCSPI_pdev[bus]);
+         while(bus--)
+            platform_device_unregister(MCSPI_pdev[bus]);
+         platform_driver_unregister(&MCSPI_driver);
+         class_destroy(MCSPI_Class);
+         unregister_chrdev_region(MCSPI_devt, MCSPI_NUM_BUSES * MCSPI_NUM_CHANNELS);
+         DEBUG_ALERT("%s: Failed to add MCSPI%d\n", DEVICE_NAME, bus);
+         return err;
+      }
    }
-   DEBUG_NORM("%s: device class created correctly\n", DEVICE_NAME); // Made it! device was initialized
 
-   mutex_init(&MCSPI_mutex);
    return 0;
 }
 
@@ -200,45 +558,81 @@ static int __init MCSPI_init(void){
 *    @return returns 0 if successful
  .............................................................................*/
 static void __exit MCSPI_exit(void){
-   mutex_destroy(&MCSPI_mutex);
-   device_destroy(MCSPI_Class, MKDEV(majorNumber, 0));     // remove the device
+   int bus;
+
+   for(bus = 0 ; bus < MCSPI_NUM_BUSES ; bus++)
+     platform_device_unregister(MCSPI_pdev[bus]);           // remove() runs for each
+   platform_driver_unregister(&MCSPI_driver);
    class_unregister(MCSPI_Class);                          // unregister the device class
    class_destroy(MCSPI_Class);                             // remove the device class
-   unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
+   unregister_chrdev_region(MCSPI_devt, MCSPI_NUM_BUSES * MCSPI_NUM_CHANNELS); // give back the numbers
    DEBUG_ALERT("%s: Driver unloaded\n", DEVICE_NAME);
 }
 
-/*
-//this is yet to be formulated and included
-static int MCSPI_probe(struct platform_device *pdev)
+
+/*..............................................................................
+*    @brief The client context of an open(): a copy of the default settings
+*           and its own receive ring and asynchronous write queue
+*    @params: data: the controller the file was opened on
+*    @return: the client or NULL
+ .............................................................................*/
+static struct MCSPI_client *MCSPI_client_alloc(struct MCSPI_data *data)
 {
-  return 0;
+  struct MCSPI_client *client = kzalloc(sizeof(*client), GFP_KERNEL);
+  if(!client)
+    return NULL;
+
+  client->data = data;
+  client->config = mcspi_defaults;
+
+  init_waitqueue_head(&client->rx_wait);
+  init_waitqueue_head(&client->msg.tx_wait);
+  mutex_init(&client->msg.msg_mutex);
+  mutex_init(&client->rx_mutex);
+  INIT_WORK(&client->msg.tx_work, MCSPI_tx_work);
+  INIT_LIST_HEAD(&client->aio_writes);
+  INIT_LIST_HEAD(&client->aio_reads);
+  spin_lock_init(&client->aio_lock);
+  spin_lock_init(&client->resp.lock);
+  INIT_WORK(&client->aio_work, MCSPI_aio_work);
+  atomic_set(&client->msg.pending, 0);
+  client->msg.buffer_length = MCSPI_TX_CHUNK;
+  client->msg.msg = kmalloc(MCSPI_TX_CHUNK, GFP_KERNEL);
+
+  if(!client->msg.msg ||
+     kfifo_alloc(&client->msg.tx_fifo, MCSPI_TX_RING_SIZE, GFP_KERNEL) ||
+     kfifo_alloc(&client->rx_fifo, MCSPI_RX_RING_SIZE, GFP_KERNEL))
+  {
+    //kfifo_free/kfree are fine with what was not allocated
+    kfifo_free(&client->msg.tx_fifo);
+    kfree(client->msg.msg);
+    kfree(client);
+    return NULL;
+  }
+
+  return client;
 }
 
-//this is yet to be formulated and included
-static int MCSPI_remove(struct platform_device *pdev)
+static void MCSPI_client_free(struct MCSPI_client *client)
 {
-  return 0;
+  kfifo_free(&client->rx_fifo);
+  kfifo_free(&client->msg.tx_fifo);
+  kfree(client->msg.msg);
+  vfree(client->map_buf);
+  vfree(client->capture_buf);
+  kfree(client->resp.buf[0]);
+  kfree(client->resp.buf[1]);
+  mutex_destroy(&client->msg.msg_mutex);
+  mutex_destroy(&client->rx_mutex);
+  kfree(client);
 }
 
-//this is yet to be formulated and included
-static struct platform_driver MCSPI_driver = {
-  .driver = {
-    .name = DEVICE_NAME,
-    .owner = THIS_MODULE,
-  },
-  .probe = MCSPI_probe,
-  .remove = MCSPI_remove,
-};
-*/
-
 
 /*..............................................................................
 *    @brief The device open function that is called each time the device is opened
-*           - Sets up the clock for the MCSPI module
-*           - maps the physical registers to the virtual kernel space
-*           - Configures the MCSPI module
-*           - Sets the mux mode
+*           - Gives the file its own client with the default settings, on
+*             the channel of the node (/dev/MCSPI<bus>.<channel>)
+*           - Configures the MCSPI module for the client
 *           - Enable the MCSPI module
 *    @param: inodep A pointer to an inode object (defined in linux/fs.h)
 *            filep A pointer to a file object (defined in linux/fs.h)
@@ -246,110 +640,320 @@ static struct platform_driver MCSPI_driver = {
  .............................................................................*/
 static int MCSPI_open(struct inode *inodep, struct file *filep){
 
-  int err_val = 0;
-  data->device = &mcspi;
-  data->device_id = MKDEV(majorNumber, 0);
-  data->numberOpens++;
-  filep->private_data = data;
+  struct MCSPI_data *data = container_of(inodep->i_cdev, struct MCSPI_data, cdev);
+  struct MCSPI_client *client;
+  int opens;
 
-  //cannot open more than 1 file for the SPI driver (for now)
-  if(data->numberOpens>1)
-   return -EUSERS;
+  client = MCSPI_client_alloc(data);
+  if(!client)
+    return -ENOMEM;
 
-  //enable the clock and check for errors.
-  err_val = clock_start_stop(1);
-  if(err_val < 0)
-    return err_val;
+  //every node drives its own chip select
+  client->config.channel_number = MINOR(inodep->i_rdev) - MINOR(data->device_id);
 
+  //the controller is on since probe
+  client->config.base_addr = data->base_addr;
+  client->config.regs = &data->regs;
 
-  res=request_mem_region(MCSPI0_START, MCSPI0_ADDR_SIZE, "MCSPI0 register space");
-  if(res==NULL)
-  {
-    DEBUG_ALERT("%s: Open: Couldn't acquire the memory region\n", DEVICE_NAME);
-    //return -EBUSY;
-  }
+  mutex_lock(&data->open_lock);
+  opens = ++data->numberOpens;
+  mutex_unlock(&data->open_lock);
 
-  data->device->base_addr = (void __iomem *)ioremap_nocache(MCSPI0_START, MCSPI0_ADDR_SIZE);
+  //the module comes up with the settings of the first client straight away
+  //(e.g. for the idle level of the CS), the others get them with their
+  //first message
+  MCSPI_bus_claim_idle(client);
 
-  if (IS_ERR(data->device->base_addr)){
-    DEBUG_NORM("%s: Open: IO mem remap unsuccessful. Error Code: %ld \n ", DEVICE_NAME, PTR_ERR(data->device->base_addr));
-    return -PTR_ERR(data->device->base_addr);
-  }
+  filep->private_data = client;
 
-  DEBUG_NORM("%s: Open: IO mem remap successful(0x%08lx)\n ", DEVICE_NAME, (unsigned long)data->device->base_addr);
+  DEBUG_NORM("%s: Open: Device enabled\n", DEVICE_NAME);
+  DEBUG_ALERT("%s%d: Open: Device opened successfully (%d open)\n", DEVICE_NAME, data->pdata->bus_num, opens);
+   return nonseekable_open(inodep, filep);
+}
 
-  if(MCSPI_configure(data->device))
-  {
-    DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
-    return -EBUSY;
-  }
 
-  MCSPI_mux_mode_set();
+/*
+Wait for the receive (or capture, see MCSPI_rx_ring) ring to have something in
+it. Returns 1 once it does, 0 if nothing can ever arrive (the channel only
+transmits) or an error. During a capture the FIFO is looked at every
+MCSPI_CAPTURE_POLL_MS, less than a chunk doesn't raise an IRQ.
+*/
+static int MCSPI_rx_wait(struct file *filep, struct MCSPI_client *client){
+   bool capturing;
+   long ret;
 
-  MCSPI_enable(data->device, 1);
+   while(kfifo_is_empty(MCSPI_rx_ring(client)))
+   {
+     capturing = (client->data->capture.client == client);
+     if(capturing)
+     {
+       MCSPI_capture_poll(client);
+       if(!kfifo_is_empty(MCSPI_rx_ring(client)))
+         break;
+     }
+     else if(client->config.tx_rx == MCSPI_CHCONF_TRM_TX)
+       return 0;
+
+     if(filep->f_flags & O_NONBLOCK)
+       return -EAGAIN;
+
+     if(capturing)
+       ret = wait_event_interruptible_timeout(client->rx_wait, !kfifo_is_empty(MCSPI_rx_ring(client)),
+                                              msecs_to_jiffies(MCSPI_CAPTURE_POLL_MS));
+     else
+       ret = wait_event_interruptible(client->rx_wait, !kfifo_is_empty(MCSPI_rx_ring(client)));
+     if(ret < 0)
+       return -ERESTARTSYS;
+   }
+   return 1;
+}
 
-  DEBUG_NORM("%s: Open: Device enabled\n", DEVICE_NAME);
-  DEBUG_NORM("%s: Open: Configuration of device successful\n", DEVICE_NAME);
-  DEBUG_ALERT("%s: Open: Device opened successfully\n", DEVICE_NAME);
-   return nonseekable_open(inodep, filep);
+
+/*
+MCSPI_rx_wait, then take client->rx_mutex, the consumer lock of the rings.
+Another reader may have emptied the ring in between, then it waits again.
+Returns 1 with the lock held, 0 or an error without it.
+*/
+static int MCSPI_rx_lock(struct file *filep, struct MCSPI_client *client){
+   int err;
+
+   for(;;)
+   {
+     err = MCSPI_rx_wait(filep, client);
+     if(err <= 0)
+       return err;
+
+     if(mutex_lock_interruptible(&client->rx_mutex))
+       return -ERESTARTSYS;
+     if(!kfifo_is_empty(MCSPI_rx_ring(client)))
+       return 1;
+     mutex_unlock(&client->rx_mutex);
+   }
 }
 
 
 /*..............................................................................
  *  @Brief: This function is called whenever device is being read from user space
- *          i.e. data is being sent from the device to the user.
+ *          i.e. data is being sent from the device to the user. The words
+ *          received by the earlier transfers are taken out of the receive ring.
+ *          If there are fewer than asked for, what is there is returned (short
+ *          read). An empty ring blocks until a transfer brings in data, unless
+ *          the file is O_NONBLOCK (-EAGAIN) or the channel only transmits, in
+ *          which case nothing can ever arrive and 0 is returned. During a
+ *          slave capture (and until what it captured is read) the words come
+ *          from the capture ring instead.
  *  @Params: filep: A pointer to a file object (defined in linux/fs.h)
  *           buffer: Pointer to the buffer to which this function writes the data
  *                   len: The length of the message copied to buffer
  *                   offset: The offset if required
- *  @Return: Error value or 0
+ *  @Return: Number of bytes read or error value
  .............................................................................*/
 static ssize_t MCSPI_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset){
-   int error_count = 0;
+   int error_count = 0, err;
+   unsigned int copied = 0;
+   struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+   struct kfifo *ring;
+   int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+
+   //the buffer is read as packed words of the configured word length
+   if(len % wl_bytes)
+     return -EINVAL;
+
+   err = MCSPI_rx_lock(filep, client);
+   if(err <= 0)
+     return err;
 
-   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, size_of_message);
+   ring = MCSPI_rx_ring(client);
+   len = min_t(size_t, len, kfifo_len(ring));
+   len -= len % wl_bytes;
 
-   memset(message, '\0', size_of_message + 1);
-   size_of_message = 0;
+   // kfifo_to_user copies straight out of the ring and returns 0 on success
+   error_count = kfifo_to_user(ring, buffer, len, &copied);
+   mutex_unlock(&client->rx_mutex);
 
    if (error_count==0){            // if true then have success
-      DEBUG_NORM("%s: Sent %d characters to the user\n", DEVICE_NAME, size_of_message);
-      return (size_of_message=0);  // clear the position to the start and return 0
+      DEBUG_NORM("%s: Sent %u characters to the user\n", DEVICE_NAME, copied);
+      return copied;
    }
    else {
-      DEBUG_ALERT("%s: Failed to send %d characters to the user\n", DEVICE_NAME, error_count);
+      DEBUG_ALERT("%s: Failed to send %zu characters to the user\n", DEVICE_NAME, len);
       return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
    }
 }
 
 
+/*..............................................................................
+ *  @Brief: readv() counterpart of MCSPI_read. The words are scattered over
+ *          the segments in order, a word may be split across two of them.
+ *          They only leave the ring once they are in the user buffers. An
+ *          AIO read that finds the ring empty is queued and completed by
+ *          MCSPI_aio_work when words come in.
+ *  @Params: iocb: the file and position of the request
+ *           to: the user segments
+ *  @Return: Number of bytes read or error value
+ .............................................................................*/
+static ssize_t MCSPI_read_iter(struct kiocb *iocb, struct iov_iter *to){
+   struct MCSPI_client *client = (struct MCSPI_client *)iocb->ki_filp->private_data;
+   int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+   ssize_t copied;
+   int err;
+
+   if(iov_iter_count(to) % wl_bytes)
+     return -EINVAL;
+
+   //AIO: nothing to hand out yet, complete it once there is
+   if(!is_sync_kiocb(iocb) && kfifo_is_empty(MCSPI_rx_ring(client)) &&
+      (client->config.tx_rx != MCSPI_CHCONF_TRM_TX || client->data->capture.client == client) &&
+      !(iocb->ki_filp->f_flags & O_NONBLOCK))
+     return MCSPI_aio_read(client, iocb, to);
+
+   err = MCSPI_rx_lock(iocb->ki_filp, client);
+   if(err <= 0)
+     return err;
+
+   copied = MCSPI_rx_pull(client, to);
+   mutex_unlock(&client->rx_mutex);
+
+   DEBUG_NORM("%s: Sent %zd characters to the user\n", DEVICE_NAME, copied);
+   return copied;
+}
+
+
+/*..............................................................................
+ *  @Brief: write() of the asynchronous mode. The words are only copied into the
+ *          transmit ring and sent later by MCSPI_tx_work, so this returns as
+ *          soon as they fit. A full ring blocks, or with O_NONBLOCK returns
+ *          what did fit (-EAGAIN if nothing did). Errors of the transfers are
+ *          reported by fsync()/MCSPI_FLUSH.
+ *          The user segments are gathered through a bounce buffer of at most
+ *          MCSPI_TX_CHUNK bytes, so the ring only ever holds whole words.
+ *  @Parameters: filep: A pointer to a file object
+ *              from: the user segments holding the words to write
+ *              wl_bytes: bytes per word
+ *  @Return: Number of bytes queued or error value
+ .............................................................................*/
+static ssize_t MCSPI_write_async(struct file *filep, struct iov_iter *from, int wl_bytes){
+
+   struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+   struct MCSPI_msg *queue = &client->msg;
+   size_t len = iov_iter_count(from);
+   unsigned int room, block;
+   size_t done = 0;
+   void *buf;
+   int err = 0;
+
+   buf = kmalloc(min_t(size_t, len, MCSPI_TX_CHUNK), GFP_KERNEL);
+   if(!buf)
+     return -ENOMEM;
+
+   if(mutex_lock_interruptible(&queue->msg_mutex))
+   {
+     kfree(buf);
+     return -ERESTARTSYS;
+   }
+
+   while(done < len)
+   {
+     room = kfifo_avail(&queue->tx_fifo);
+     room -= room % wl_bytes;
+
+     if(room == 0)
+     {
+       if(filep->f_flags & O_NONBLOCK)
+       {
+         err = done ? 0 : -EAGAIN;
+         break;
+       }
+
+       //let the worker make room without holding the producer lock
+       mutex_unlock(&queue->msg_mutex);
+       if(wait_event_interruptible(queue->tx_wait, kfifo_avail(&queue->tx_fifo) >= wl_bytes))
+       {
+         kfree(buf);
+         return done ? done : -ERESTARTSYS;
+       }
+       if(mutex_lock_interruptible(&queue->msg_mutex))
+       {
+         kfree(buf);
+         return done ? done : -ERESTARTSYS;
+       }
+       continue;
+     }
+
+     block = min_t(size_t, len - done, min_t(unsigned int, room, MCSPI_TX_CHUNK));
+     if(!copy_from_iter_full(buf, block, from))
+     {
+       err = -EFAULT;
+       break;
+     }
+
+     kfifo_in(&queue->tx_fifo, buf, block);
+     atomic_add(block, &queue->pending);
+     queue_work(client->data->wq, &queue->tx_work);
+     done += block;
+   }
+
+   mutex_unlock(&queue->msg_mutex);
+   kfree(buf);
+
+   DEBUG_NORM("%s: Queued %zu characters from the user\n", DEVICE_NAME, done);
+   return done ? done : err;
+}
+
+
 /*..............................................................................
  *  @Brief: This function is called whenever the device is being written to from
  *         user space i.e. data is sent to the device from the user. The data is
- *         copied to the message[] array and then sent for further processing.
+ *         copied to a kernel buffer and then sent for further processing. The
+ *         buffer holds packed words of the configured word length (u8, u16 or
+ *         u32 each), so len has to be a multiple of the word size.
  *  @Parameters: filep: A pointer to a file object
- *              buffer: Buffer containing the string to write to the device
- *              len: The length of the array of data (buffer)
+ *              buffer: Buffer containing the words to write to the device
+ *              len: The length of the array of data (buffer) in bytes
  *              offset: The offset if required
  *  @Return: Error value or 0
  .............................................................................*/
 static ssize_t MCSPI_write(struct file *filep, const char __user *buffer, size_t len, loff_t *offset){
 
-   char message[len];
+   char *message;
    int error_count=0;
-   struct MCSPI_data *data = (struct MCSPI_data *)filep->private_data;
-   struct MCSPI *mcspi = data->device;
+   struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+   struct MCSPI *mcspi = &client->config;
+   int wl_bytes = MCSPI_CHCONF_WL_BYTES(mcspi->word_length);
 
-   //get the data from user to kernel space
-   error_count = copy_from_user(message, buffer, len);
+   if(len % wl_bytes)
+     return -EINVAL;
 
-   if(error_count)
-	    DEBUG_ALERT("String was too long, could not copy %d cahracters\n", error_count);
+   if(mcspi->async)
+   {
+     struct iovec iov;
+     struct iov_iter from;
 
-   if( MCSPI_send_data_poll(mcspi, message, len-error_count) < 0)
+     error_count = import_single_range(WRITE, (void __user *)buffer, len, &iov, &from);
+     if(error_count)
+       return error_count;
+     return MCSPI_write_async(filep, &from, wl_bytes);
+   }
+
+   //kmalloc'd so that the words are naturally aligned for u16/u32 access
+   message = kmalloc(len, GFP_KERNEL);
+   if(!message)
+     return -ENOMEM;
+
+   //get the data from user to kernel space, a truncated message is not sent
+   if(copy_from_user(message, buffer, len))
    {
-     DEBUG_ALERT("%s: Write: Timeout in sending data\n", DEVICE_NAME);
+     kfree(message);
+     return -EFAULT;
+   }
+
+   error_count = MCSPI_transfer(client, message, len);
+   kfree(message);
+
+   if(error_count < 0)
+   {
+     DEBUG_ALERT("%s: Write: sending failed (%d)\n", DEVICE_NAME, error_count);
+     return error_count;
    }
 
    DEBUG_NORM("%s: Received %zu characters from the user\n", DEVICE_NAME, len);
@@ -357,6 +961,42 @@ static ssize_t MCSPI_write(struct file *filep, const char __user *buffer, size_t
 }
 
 
+/*..............................................................................
+ *  @Brief: writev() counterpart of MCSPI_write. All the segments go out as one
+ *          transfer under a single CS assertion (e.g. a header and a payload
+ *          from separate buffers), see MCSPI_transfer_iter. Only the total has
+ *          to be a multiple of the word size. In the asynchronous mode the
+ *          segments are queued like a single write(). An AIO request (not a
+ *          sync kiocb) is queued for MCSPI_aio_work and completed from there.
+ *  @Parameters: iocb: the file and position of the request
+ *              from: the user segments
+ *  @Return: Number of bytes sent/queued or error value
+ .............................................................................*/
+static ssize_t MCSPI_write_iter(struct kiocb *iocb, struct iov_iter *from){
+   struct MCSPI_client *client = (struct MCSPI_client *)iocb->ki_filp->private_data;
+   struct MCSPI *mcspi = &client->config;
+   int wl_bytes = MCSPI_CHCONF_WL_BYTES(mcspi->word_length);
+   size_t len = iov_iter_count(from);
+   ssize_t ret;
+
+   if(len % wl_bytes)
+     return -EINVAL;
+   if(!len)
+     return 0;
+
+   if(mcspi->async)
+     return MCSPI_write_async(iocb->ki_filp, from, wl_bytes);
+
+   if(!is_sync_kiocb(iocb))
+     return MCSPI_aio_write(client, iocb, from);
+
+   ret = MCSPI_transfer_iter(client, from);
+
+   DEBUG_NORM("%s: Sent %zd of %zu characters from the user\n", DEVICE_NAME, ret, len);
+   return ret;
+}
+
+
 /*..............................................................................
  *   @brief: The device release function that is called whenever the device is
  *           closed/released by the userspace program
@@ -365,25 +1005,430 @@ static ssize_t MCSPI_write(struct file *filep, const char __user *buffer, size_t
  *   @return
  .............................................................................*/
 static int MCSPI_release(struct inode *inodep, struct file *filep){
-   struct MCSPI_data *data = (struct MCSPI_data *)filep->private_data;
-   struct MCSPI *mcspi = data->device;
-
-   //reduce the number of times this is opened
+   struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+   struct MCSPI_data *data = client->data;
+
+   //a capture would go on filling the ring of the freed client, the
+   //response mode sending from its buffers
+   MCSPI_capture_stop(client);
+   MCSPI_response_stop(client);
+
+   //whatever is still queued goes out before the client goes away, unless
+   //it can't get out at all
+   MCSPI_flush_timeout(client, MCSPI_RELEASE_FLUSH_MS);
+   flush_work(&client->msg.tx_work);
+
+   //every AIO request holds the file, so none is left, but the worker may
+   //still be on its way out after completing the last one
+   flush_work(&client->aio_work);
+
+   //the module must not keep pointing at the settings of a freed client
+   mutex_lock(&data->bus_lock);
+   if(data->active == client)
+     data->active = NULL;
+   if(data->device == &client->config)
+     data->device = NULL;
+   mutex_unlock(&data->bus_lock);
+
+   //the controller stays on for the next open, see MCSPI_hw_start
+   mutex_lock(&data->open_lock);
    data->numberOpens--;
+   mutex_unlock(&data->open_lock);
 
-   MCSPI_enable(mcspi, 0);
+   MCSPI_client_free(client);
 
-   //unmap the mapped memory address
-   iounmap(mcspi->base_addr);
+   DEBUG_ALERT("%s: Device successfully closed\n",  DEVICE_NAME);
+   return 0;
+}
 
-   //stop the clock to the SPI0 module
-   clock_start_stop(0);
 
-   //Unlock the mutex for the next process which open()s this device
-   mutex_unlock(&MCSPI_mutex);
+/*..............................................................................
+ *   @brief: fsync() waits until the asynchronous writes are all sent
+ *   @param: filep: A pointer to a file object (defined in linux/fs.h)
+ *           start, end, datasync: unused, there is no backing store
+ *   @return 0, or the error of the first failed transfer since the last sync
+ .............................................................................*/
+static int MCSPI_fsync(struct file *filep, loff_t start, loff_t end, int datasync){
+   struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+   return MCSPI_flush(client);
+}
 
-   DEBUG_ALERT("%s: Device successfully closed\n",  DEVICE_NAME);
-   return 0;
+
+/*..............................................................................
+ *   @brief: poll()/select()/epoll. Readable while the receive ring (the
+ *           capture ring in a slave capture) holds words. Writable while a
+ *           write() would not wait for room: in the asynchronous mode while
+ *           the transmit ring has room for a word, in the slave response
+ *           mode while a response can be staged, otherwise always (the
+ *           write() is the transfer). A failed asynchronous transfer
+ *           shows as EPOLLERR until fsync() reports it. MCSPI_rx_push and
+ *           MCSPI_tx_work do the wakeups.
+ *   @param: filep: A pointer to a file object (defined in linux/fs.h)
+ *           wait: the poll table
+ *   @return the ready events
+ .............................................................................*/
+static __poll_t MCSPI_poll(struct file *filep, struct poll_table_struct *wait){
+   struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+   struct MCSPI_msg *queue = &client->msg;
+   int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+   __poll_t mask = 0;
+
+   poll_wait(filep, &client->rx_wait, wait);
+   poll_wait(filep, &queue->tx_wait, wait);
+
+   if(client->data->capture.client == client && kfifo_is_empty(MCSPI_rx_ring(client)))
+     MCSPI_capture_poll(client);
+   if(!kfifo_is_empty(MCSPI_rx_ring(client)))
+     mask |= EPOLLIN | EPOLLRDNORM;
+
+   if(client->data->responder == client)
+   {
+     if(!client->resp.staged)
+       mask |= EPOLLOUT | EPOLLWRNORM;
+   }
+   else if(!client->config.async || kfifo_avail(&queue->tx_fifo) >= wl_bytes)
+     mask |= EPOLLOUT | EPOLLWRNORM;
+
+   if(queue->error)
+     mask |= EPOLLERR;
+
+   return mask;
+}
+
+
+/*..............................................................................
+ *   @brief: Maps a driver owned buffer of the file into user space, for the
+ *           transfers without copies of MCSPI_IOC_XFER_MAPPED. The buffer is
+ *           allocated by the first mmap() (at offset 0, up to MCSPI_MAP_MAX)
+ *           and stays with the file; later mmap()s get the same buffer
+ *   @param: filep: A pointer to a file object (defined in linux/fs.h)
+ *           vma: the user mapping
+ *   @return 0, or error
+ .............................................................................*/
+static int MCSPI_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+  struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+  unsigned long size = vma->vm_end - vma->vm_start;
+  int err = 0;
+
+  if(vma->vm_pgoff != 0 || size > MCSPI_MAP_MAX)
+    return -EINVAL;
+
+  //the transfers look at the buffer under the bus lock
+  mutex_lock(&client->data->bus_lock);
+
+  if(!client->map_buf)
+  {
+    client->map_buf = vmalloc_user(size);
+    if(!client->map_buf)
+      err = -ENOMEM;
+    else
+      client->map_size = size;
+  }
+
+  if(!err && size > client->map_size)
+    err = -EINVAL;
+  if(!err)
+    err = remap_vmalloc_range(vma, client->map_buf, 0);
+
+  mutex_unlock(&client->data->bus_lock);
+
+  DEBUG_NORM("%s: mmap: %lu bytes (%d)\n", DEVICE_NAME, size, err);
+  return err;
+}
+
+
+/*..............................................................................
+ *   @brief: MCSPI_IOC_XFER_MAPPED: sends a part of the mmap()ed buffer in
+ *           place, the received words overwrite it. Called with the bus lock
+ *           held, like the SET commands. Streams (CS held, TURBO) like write()
+ *   @param: client: the client of the file
+ *           arg: the user's struct mcspi_ioc_mapped
+ *   @return the number of bytes sent, or error
+ .............................................................................*/
+static long MCSPI_ioc_mapped(struct MCSPI_client *client, struct mcspi_ioc_mapped __user *arg)
+{
+  struct mcspi_ioc_mapped xfer;
+  int wl_bytes = MCSPI_CHCONF_WL_BYTES(client->config.word_length);
+  int err;
+
+  if(copy_from_user(&xfer, arg, sizeof(xfer)))
+    return -EFAULT;
+
+  if(!client->map_buf)
+    return -ENXIO;
+  if(xfer.len == 0 || xfer.offset % wl_bytes || xfer.len % wl_bytes ||
+     xfer.offset > client->map_size || xfer.len > client->map_size - xfer.offset)
+    return -EINVAL;
+
+  //the bus lock is held by MCSPI_ioctl, streams like write()
+  err = MCSPI_send_stream(client, (u8 *)client->map_buf + xfer.offset, xfer.len);
+  if(err < 0)
+    return err;
+
+  DEBUG_NORM("%s: IOCTL: MCSPI_IOC_XFER_MAPPED: %u bytes at %u\n", DEVICE_NAME, xfer.len, xfer.offset);
+  return xfer.len;
+}
+
+
+/*..............................................................................
+ *   @brief: MCSPI_IOC_MESSAGE(N): copies the N segments and their TX data in,
+ *           runs them all with MCSPI_transfer_message and copies the received
+ *           words out to the rx_buf of each segment
+ *   @param: client: the client of the file
+ *           uxfer: the user's array of struct mcspi_ioc_transfer
+ *           size: size of the array in bytes (from the command)
+ *   @return total length of the segments, or error
+ .............................................................................*/
+static long MCSPI_ioc_message(struct MCSPI_client *client, struct mcspi_ioc_transfer __user *uxfer, unsigned int size)
+{
+  struct mcspi_ioc_transfer *xfer;
+  struct MCSPI_segment *seg;
+  u8 *buf = NULL;
+  unsigned int n, i, offset, total = 0;
+  long err = 0;
+
+  if(size == 0 || size % sizeof(*xfer))
+    return -EINVAL;
+  n = size / sizeof(*xfer);
+
+  xfer = memdup_user(uxfer, size);
+  if(IS_ERR(xfer))
+    return PTR_ERR(xfer);
+
+  seg = kcalloc(n, sizeof(*seg), GFP_KERNEL);
+  if(!seg)
+  {
+    kfree(xfer);
+    return -ENOMEM;
+  }
+
+  //MCSPI_XFER_KEEP takes the setting of the file
+  for(i = 0 ; i < n ; i++)
+  {
+    struct MCSPI clk = client->config;
+    int clk_err = 0;
+
+    //a speed in Hz wins over the divider, which alone means no speed_hz
+    if(xfer[i].clock_div != MCSPI_XFER_KEEP)
+    {
+      clk.clock_div = xfer[i].clock_div;
+      clk.speed_hz = 0;
+    }
+    if(xfer[i].speed_hz)
+      clk_err = MCSPI_speed_set(&clk, xfer[i].speed_hz);
+
+    seg[i].clock_div = clk.clock_div;
+    seg[i].speed_hz = clk.speed_hz;
+    seg[i].word_length = (xfer[i].word_length == MCSPI_XFER_KEEP) ? client->config.word_length : xfer[i].word_length;
+    seg[i].tx_rx = xfer[i].rx_buf ? MCSPI_CHCONF_TRM_TX_RX : MCSPI_CHCONF_TRM_TX;
+    seg[i].len = xfer[i].len;
+    seg[i].delay_usecs = xfer[i].delay_usecs;
+    seg[i].cs_change = xfer[i].cs_change;
+
+    //the CS is always released at the end of the message, there is no
+    //keeping it asserted after the last segment
+    if(clk_err || (seg[i].cs_change && i == n-1) || seg[i].clock_div > CLK_32768 ||
+       (seg[i].word_length != MCSPI_CHCONF_WL_8BIT && seg[i].word_length != MCSPI_CHCONF_WL_16BIT &&
+        seg[i].word_length != MCSPI_CHCONF_WL_32BIT) ||
+       xfer[i].len % MCSPI_CHCONF_WL_BYTES(seg[i].word_length))
+    {
+      err = -EINVAL;
+      goto out;
+    }
+
+    //every segment starts word aligned in the kernel buffer. A single length
+    //is checked first, ALIGN would wrap one close to 4 GB around to 0
+    if(xfer[i].len > MCSPI_MSG_MAX)
+    {
+      err = -EMSGSIZE;
+      goto out;
+    }
+    total += ALIGN(xfer[i].len, 4);
+    if(total > MCSPI_MSG_MAX)
+    {
+      err = -EMSGSIZE;
+      goto out;
+    }
+  }
+
+  buf = kzalloc(total, GFP_KERNEL);
+  if(!buf)
+  {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  for(i = 0, offset = 0 ; i < n ; offset += ALIGN(xfer[i].len, 4), i++)
+  {
+    seg[i].buf = buf + offset;
+    if(xfer[i].tx_buf && copy_from_user(seg[i].buf, u64_to_user_ptr(xfer[i].tx_buf), xfer[i].len))
+    {
+      err = -EFAULT;
+      goto out;
+    }
+  }
+
+  //the asynchronous writes of the file were queued before this, a failure
+  //of theirs is reported here rather than lost
+  err = MCSPI_flush(client);
+  if(err)
+    goto out;
+
+  err = MCSPI_transfer_message(client, seg, n);
+  if(err)
+    goto out;
+
+  for(i = 0 ; i < n ; i++)
+  {
+    if(xfer[i].rx_buf && copy_to_user(u64_to_user_ptr(xfer[i].rx_buf), seg[i].buf, xfer[i].len))
+    {
+      err = -EFAULT;
+      goto out;
+    }
+    err += xfer[i].len;
+  }
+
+  DEBUG_NORM("%s: IOCTL: MCSPI_IOC_MESSAGE: %u segments, %ld bytes\n", DEVICE_NAME, n, err);
+
+out:
+  kfree(buf);
+  kfree(seg);
+  kfree(xfer);
+  return err;
+}
+
+
+/*..............................................................................
+ *   @brief: MCSPI_PROFILE_SET: checks every setting of the profile the way the
+ *           _SET commands do and registers it for MCSPI_PROFILE_ACTIVATE
+ *   @param: client: the client of the file
+ *           uprof: the user's struct mcspi_ioc_profile
+ *   @return 0, or error
+ .............................................................................*/
+static long MCSPI_ioc_profile(struct MCSPI_client *client, struct mcspi_ioc_profile __user *uprof)
+{
+  struct mcspi_ioc_profile prof;
+  struct MCSPI config = client->config;
+
+  if(copy_from_user(&prof, uprof, sizeof(prof)))
+    return -EFAULT;
+
+  if(prof.index >= MCSPI_NUM_PROFILES)
+    return -EINVAL;
+  if(prof.mode != MCSPI_MODULCTRL_MASTER && prof.mode != MCSPI_MODULCTRL_SLAVE)
+    return -EINVAL;
+  if(prof.polarity != MCSPI_CHCONF_POL_ACTIVE_HIGH && prof.polarity != MCSPI_CHCONF_POL_ACTIVE_LOW)
+    return -EINVAL;
+  if(prof.phase != MCSPI_CHCONF_PHA_ODD && prof.phase != MCSPI_CHCONF_PHA_EVEN)
+    return -EINVAL;
+  if(prof.pin_config != MCSPI_D0_IN_D1_OUT && prof.pin_config != MCSPI_D1_IN_D0_OUT)
+    return -EINVAL;
+  if(prof.clock_div < CLK_1 || prof.clock_div > CLK_32768)
+    return -EINVAL;
+  if(prof.cs != MCSPI_CS_SENSITIVE_DISABLED && prof.cs != MCSPI_CS_SENSITIVE_ENABLED)
+    return -EINVAL;
+  if(prof.trm != MCSPI_TRM_TX && prof.trm != MCSPI_TRM_RX && prof.trm != MCSPI_TRM_TX_RX)
+    return -EINVAL;
+  if(prof.word_length != MCSPI_CHCONF_WL_8BIT && prof.word_length != MCSPI_CHCONF_WL_16BIT &&
+     prof.word_length != MCSPI_CHCONF_WL_32BIT)
+    return -EINVAL;
+  if(prof.xfer_mode != MCSPI_XFER_MODE_POLL && prof.xfer_mode != MCSPI_XFER_MODE_FIFO &&
+     prof.xfer_mode != MCSPI_XFER_MODE_IRQ  && prof.xfer_mode != MCSPI_XFER_MODE_DMA &&
+     prof.xfer_mode != MCSPI_XFER_MODE_BULK)
+    return -EINVAL;
+  if(prof.xfer_mode == MCSPI_XFER_MODE_IRQ && !client->data->irq)
+    return -ENODEV;
+  if(prof.xfer_mode == MCSPI_XFER_MODE_DMA && !client->data->dma.tx_chan)
+    return -ENODEV;
+
+  config.role = prof.mode;
+  config.polarity = prof.polarity;
+  config.phase = prof.phase;
+  config.pin_direction = prof.pin_config;
+  config.clock_div = prof.clock_div;
+  if(MCSPI_speed_set(&config, prof.speed_hz))
+    return -EINVAL;
+  config.CS_sensitive = prof.cs;
+  config.tx_rx = prof.trm;
+  config.word_length = prof.word_length;
+  config.xfer_mode = prof.xfer_mode;
+
+  DEBUG_NORM("%s: IOCTL: MCSPI_PROFILE_SET: %u\n", DEVICE_NAME, prof.index);
+  return MCSPI_profile_set(client, prof.index, &config);
+}
+
+
+/*..............................................................................
+ *   @brief: MCSPI_CAPTURE_STATS: the counters of the slave capture, or of the
+ *           last one if none is running. A capture of another file on the
+ *           same controller is reported as well
+ *   @param: client: the client of the file
+ *           ustats: the user's struct mcspi_ioc_capture_stats
+ *   @return 0, or error
+ .............................................................................*/
+static long MCSPI_ioc_capture_stats(struct MCSPI_client *client, struct mcspi_ioc_capture_stats __user *ustats)
+{
+  struct MCSPI_capture *cap = &client->data->capture;
+  struct mcspi_ioc_capture_stats stats = {0};
+  unsigned long flags;
+
+  spin_lock_irqsave(&cap->lock, flags);
+  stats.words = cap->words;
+  stats.dropped = cap->dropped;
+  stats.frames = cap->frames;
+  stats.fifo_overflows = cap->fifo_overflows;
+  stats.running = (cap->client != NULL);
+  spin_unlock_irqrestore(&cap->lock, flags);
+
+  if(copy_to_user(ustats, &stats, sizeof(stats)))
+    return -EFAULT;
+  return 0;
+}
+
+
+/*..............................................................................
+ *   @brief: MCSPI_RESPONSE_STAGE: copies the next slave response in. Called
+ *           without the bus lock, the response mode holds the module
+ *   @param: client: the client of the file
+ *           uresp: the user's struct mcspi_ioc_response
+ *   @return 0, or error
+ .............................................................................*/
+static long MCSPI_ioc_response_stage(struct MCSPI_client *client, struct mcspi_ioc_response __user *uresp)
+{
+  struct mcspi_ioc_response resp;
+
+  if(copy_from_user(&resp, uresp, sizeof(resp)))
+    return -EFAULT;
+
+  DEBUG_NORM("%s: IOCTL: MCSPI_RESPONSE_STAGE: %u bytes\n", DEVICE_NAME, resp.len);
+  return MCSPI_response_stage(client, u64_to_user_ptr(resp.buf), resp.len);
+}
+
+
+/*..............................................................................
+ *   @brief: MCSPI_RESPONSE_STATS: the counters of the slave response mode of
+ *           the file (of the last run if it is stopped)
+ *   @param: client: the client of the file
+ *           ustats: the user's struct mcspi_ioc_response_stats
+ *   @return 0, or error
+ .............................................................................*/
+static long MCSPI_ioc_response_stats(struct MCSPI_client *client, struct mcspi_ioc_response_stats __user *ustats)
+{
+  struct MCSPI_response *resp = &client->resp;
+  struct mcspi_ioc_response_stats stats = {0};
+  unsigned long flags;
+
+  spin_lock_irqsave(&resp->lock, flags);
+  stats.transactions = resp->transactions;
+  stats.repeats = resp->repeats;
+  stats.underflows = resp->underflows;
+  stats.staged = resp->staged;
+  spin_unlock_irqrestore(&resp->lock, flags);
+
+  if(copy_to_user(ustats, &stats, sizeof(stats)))
+    return -EFAULT;
+  return 0;
 }
 
 
@@ -397,26 +1442,69 @@ static int MCSPI_release(struct inode *inodep, struct file *filep){
  .............................................................................*/
 long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
 {
-  struct MCSPI_data *mcspi_data = (struct MCSPI_data *)filep->private_data;
-  struct MCSPI *mcspi = mcspi_data->device;
+  struct MCSPI_client *client = (struct MCSPI_client *)filep->private_data;
+  long err;
 
   if (_IOC_TYPE(command) != MCSPI_MAGIC_NUMBER) return -ENOTTY;
   if (_IOC_NR(command) > MAX_IOCTL_NUMBER) return -ENOTTY;
 
+  //the size of the message is part of the command, so it can't be a case
+  if (_IOC_NR(command) == _IOC_NR(MCSPI_IOC_MESSAGE(0)) && _IOC_DIR(command) == _IOC_WRITE)
+    return MCSPI_ioc_message(client, (struct mcspi_ioc_transfer __user *)arg, _IOC_SIZE(command));
+
+  //staging doesn't touch the module, and has to work while the response
+  //mode holds it
+  if (command == MCSPI_RESPONSE_STAGE)
+    return MCSPI_ioc_response_stage(client, (struct mcspi_ioc_response __user *)arg);
+
+  if (_IOC_DIR(command) != _IOC_WRITE)
+    return __MCSPI_ioctl(client, command, arg);
+
+  //the queued words were written for the old settings, send them first
+  if(MCSPI_flush(client) == -ERESTARTSYS)
+    return -ERESTARTSYS;
+
+  //the settings are changed (and the module reconfigured) between messages
+  //only, never in the middle of one of another client
+  err = MCSPI_bus_lock(client);
+  if(err)
+    return err;
+
+  //a failed configuration is marked by MCSPI_bus_setup itself (the next
+  //setup starts over with a reset), any other error leaves the module as is
+  err = __MCSPI_ioctl(client, command, arg);
+
+  MCSPI_bus_unlock(client);
+  return err;
+}
+
+
+/*..............................................................................
+ *   @brief: The commands of MCSPI_ioctl. The SET commands are called with the
+ *           bus lock held, the module already configured for the client
+ *   @param: client: the client of the file
+ *           command: the command being sent to the driver
+ *           arg: the argument to be sent with the command
+ *   @return error code/return value for the command
+ .............................................................................*/
+static long __MCSPI_ioctl(struct MCSPI_client *client, unsigned int command, unsigned long arg)
+{
+  struct MCSPI_data *mcspi_data = client->data;
+  struct MCSPI *mcspi = &client->config;
+
   switch(command)
   {
     case MCSPI_MODE_SET :
                          if(arg == MCSPI_MODULCTRL_MASTER  ||  arg == MCSPI_MODULCTRL_SLAVE)
                          {
                            mcspi->role = arg;
-                           if(MCSPI_configure(mcspi))
+                           if(MCSPI_bus_setup(client))
                            {
                              DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                              return -EBUSY;
                            }
                            DEBUG_NORM("%s: IOCTL: MCSPI_MODE_SET: %ld\n", DEVICE_NAME, arg);
                          }
-                         MCSPI_enable(mcspi, 1);
                          return 0;
                          break;
 
@@ -434,14 +1522,13 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                             arg == MCSPI_CHCONF_POL_ACTIVE_LOW)
                          {
                            mcspi->polarity = MCSPI_CHCONF_POL_ACTIVE_HIGH;
-                           if(MCSPI_configure(mcspi))
+                           if(MCSPI_bus_setup(client))
                            {
                              DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                              return -EBUSY;
                            }
                            DEBUG_NORM("%s: IOCTL: MCSPI_POL_SET: %ld\n", DEVICE_NAME, arg);
                          }
-                         MCSPI_enable(mcspi, 1);
                          return 0;
                          break;
 
@@ -459,14 +1546,13 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                              arg == MCSPI_CHCONF_PHA_EVEN )
                           {
                             mcspi->phase = arg;
-                            if(MCSPI_configure(mcspi))
+                            if(MCSPI_bus_setup(client))
                             {
                               DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                               return -EBUSY;
                             }
                             DEBUG_NORM("%s: IOCTL: MCSPI_PHA_SET: %ld\n", DEVICE_NAME, arg);
                           }
-                          MCSPI_enable(mcspi, 1);
                           return 0;
                           break;
 
@@ -484,14 +1570,13 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                              arg == MCSPI_D1_IN_D0_OUT)
                           {
                             mcspi->pin_direction = arg;
-                            if(MCSPI_configure(mcspi))
+                            if(MCSPI_bus_setup(client))
                             {
                               DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                               return -EBUSY;
                             }
                             DEBUG_NORM("%s: IOCTL: MCSPI_PIN_DIRECTION: %ld\n", DEVICE_NAME, arg);
                           }
-                          MCSPI_enable(mcspi, 1);
                           return 0;
                           break;
 
@@ -508,14 +1593,14 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                           if(arg >= CLK_1  && arg <=CLK_32768)
                           {
                             mcspi->clock_div = arg;
-                            if(MCSPI_configure(mcspi))
+                            mcspi->speed_hz = 0;
+                            if(MCSPI_bus_setup(client))
                             {
                               DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                               return -EBUSY;
                             }
                             DEBUG_NORM("%s: IOCTL: MCSPI_CLKD: %ld\n", DEVICE_NAME, arg);
                           }
-                          MCSPI_enable(mcspi, 1);
                           return 0;
                           break;
 
@@ -528,19 +1613,42 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                           break;
 
 
+    case MCSPI_SPEED_HZ_SET:
+                          //MCSPI_CLKD_SET is the way back to the power of two dividers
+                          if(arg == 0 || arg > U32_MAX || MCSPI_speed_set(mcspi, arg))
+                            return -EINVAL;
+                          if(MCSPI_bus_setup(client))
+                          {
+                            DEBUG_ALERT("%s: IOCTL: MCSPI_SPEED_HZ: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
+                            return -EBUSY;
+                          }
+                          DEBUG_NORM("%s: IOCTL: MCSPI_SPEED_HZ: %ld, running at %u Hz\n", DEVICE_NAME, arg,
+                                     MCSPI_FCLK_HZ / MCSPI_clk_divider(mcspi));
+                          //the clock actually picked
+                          return MCSPI_FCLK_HZ / MCSPI_clk_divider(mcspi);
+                          break;
+
+
+    case MCSPI_SPEED_HZ_GET:
+                          if(!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(u32)))
+                            return -EFAULT;
+                          put_user(MCSPI_FCLK_HZ / MCSPI_clk_divider(mcspi), (__u32 __user *)arg);
+                          DEBUG_NORM("%s: IOCTL: MCSPI_SPEED_HZ requested\n", DEVICE_NAME);
+                          break;
+
+
     case MCSPI_CS_SET :
                           if(arg == MCSPI_CS_SENSITIVE_DISABLED ||
                              arg == MCSPI_CS_SENSITIVE_ENABLED)
                           {
                              mcspi->CS_sensitive = arg;
-                             if(MCSPI_configure(mcspi))
+                             if(MCSPI_bus_setup(client))
                              {
                                DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                                return -EBUSY;
                              }
                              DEBUG_NORM("%s: IOCTL: MCSPI_CS: %ld\n", DEVICE_NAME, arg);
                           }
-                          MCSPI_enable(mcspi, 1);
                           return 0;
                           break;
 
@@ -557,14 +1665,13 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                           if(arg == MCSPI_TRM_TX || arg == MCSPI_TRM_RX || arg == MCSPI_TRM_TX_RX)
                           {
                              mcspi->tx_rx = arg;
-                             if(MCSPI_configure(mcspi))
+                             if(MCSPI_bus_setup(client))
                              {
                                DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
                                return -EBUSY;
                              }
                              DEBUG_NORM("%s: IOCTL: MCSPI_TX_RX: %ld\n", DEVICE_NAME, arg);
                           }
-                          MCSPI_enable(mcspi, 1);
                           return 0;
                           break;
 
@@ -576,6 +1683,165 @@ long MCSPI_ioctl(struct file *filep, unsigned int command, unsigned long arg)
                           DEBUG_NORM("%s: IOCTL: MCSPI_TX_RX requested\n", DEVICE_NAME);
                           break;
 
+
+    case MCSPI_WL_SET :
+                          if(arg == MCSPI_CHCONF_WL_8BIT || arg == MCSPI_CHCONF_WL_16BIT || arg == MCSPI_CHCONF_WL_32BIT)
+                          {
+                             mcspi->word_length = arg;
+                             if(MCSPI_bus_setup(client))
+                             {
+                               DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
+                               return -EBUSY;
+                             }
+                             DEBUG_NORM("%s: IOCTL: MCSPI_WL: %ld\n", DEVICE_NAME, arg);
+                          }
+                          return 0;
+                          break;
+
+
+    case MCSPI_WL_GET  :
+                          if(!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(u32)))
+                            return -EFAULT;
+                          put_user(mcspi->word_length, (__u32 __user *)arg);
+                          DEBUG_NORM("%s: IOCTL: MCSPI_WL requested\n", DEVICE_NAME);
+                          break;
+
+
+    case MCSPI_XFER_MODE_SET :
+                          if(arg == MCSPI_XFER_MODE_IRQ && !mcspi_data->irq)
+                            return -ENODEV;
+                          if(arg == MCSPI_XFER_MODE_DMA && !mcspi_data->dma.tx_chan)
+                            return -ENODEV;
+
+                          if(arg == MCSPI_XFER_MODE_POLL || arg == MCSPI_XFER_MODE_FIFO ||
+                             arg == MCSPI_XFER_MODE_IRQ  || arg == MCSPI_XFER_MODE_DMA  ||
+                             arg == MCSPI_XFER_MODE_BULK)
+                          {
+                             mcspi->xfer_mode = arg;
+                             if(MCSPI_bus_setup(client))
+                             {
+                               DEBUG_ALERT("%s: Open: configuration failed. (Check logs for more info)\n", DEVICE_NAME);
+                               return -EBUSY;
+                             }
+                             DEBUG_NORM("%s: IOCTL: MCSPI_XFER_MODE: %ld\n", DEVICE_NAME, arg);
+                          }
+                          return 0;
+                          break;
+
+
+    case MCSPI_ASYNC_SET :
+                          if(arg == 0 || arg == 1)
+                          {
+                             mcspi->async = arg;
+                             DEBUG_NORM("%s: IOCTL: MCSPI_ASYNC: %ld\n", DEVICE_NAME, arg);
+                          }
+                          return 0;
+                          break;
+
+
+    case MCSPI_ASYNC_GET  :
+                          if(!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(u32)))
+                            return -EFAULT;
+                          put_user(mcspi->async, (__u32 __user *)arg);
+                          DEBUG_NORM("%s: IOCTL: MCSPI_ASYNC requested\n", DEVICE_NAME);
+                          break;
+
+
+    case MCSPI_STREAM_SET :
+                          if(arg == 0 || arg == 1)
+                          {
+                             mcspi->stream = arg;
+                             DEBUG_NORM("%s: IOCTL: MCSPI_STREAM: %ld\n", DEVICE_NAME, arg);
+                          }
+                          return 0;
+                          break;
+
+
+    case MCSPI_STREAM_GET :
+                          if(!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(u32)))
+                            return -EFAULT;
+                          put_user(mcspi->stream, (__u32 __user *)arg);
+                          DEBUG_NORM("%s: IOCTL: MCSPI_STREAM requested\n", DEVICE_NAME);
+                          break;
+
+
+    case MCSPI_FLUSH      :
+                          DEBUG_NORM("%s: IOCTL: MCSPI_FLUSH\n", DEVICE_NAME);
+                          return MCSPI_flush(client);
+                          break;
+
+
+    case MCSPI_IOC_XFER_MAPPED :
+                          return MCSPI_ioc_mapped(client, (struct mcspi_ioc_mapped __user *)arg);
+                          break;
+
+
+    case MCSPI_PROFILE_SET :
+                          return MCSPI_ioc_profile(client, (struct mcspi_ioc_profile __user *)arg);
+                          break;
+
+
+    case MCSPI_PROFILE_ACTIVATE :
+                          if(arg >= MCSPI_NUM_PROFILES)
+                            return -EINVAL;
+                          DEBUG_NORM("%s: IOCTL: MCSPI_PROFILE_ACTIVATE: %ld\n", DEVICE_NAME, arg);
+                          return MCSPI_profile_activate(client, arg);
+                          break;
+
+
+    case MCSPI_CAPTURE_START :
+                          DEBUG_NORM("%s: IOCTL: MCSPI_CAPTURE_START: %ld\n", DEVICE_NAME, arg);
+                          return MCSPI_capture_start(client, arg);
+                          break;
+
+
+    case MCSPI_CAPTURE_STOP :
+                          DEBUG_NORM("%s: IOCTL: MCSPI_CAPTURE_STOP\n", DEVICE_NAME);
+                          return MCSPI_capture_stop(client);
+                          break;
+
+
+    case MCSPI_CAPTURE_STATS :
+                          return MCSPI_ioc_capture_stats(client, (struct mcspi_ioc_capture_stats __user *)arg);
+                          break;
+
+
+    case MCSPI_RESPONSE_START :
+                          {
+                            long err;
+
+                            //not a SET command, the bus is taken here
+                            if(MCSPI_flush(client) == -ERESTARTSYS)
+                              return -ERESTARTSYS;
+                            err = MCSPI_bus_lock(client);
+                            if(err)
+                              return err;
+                            err = MCSPI_response_start(client);
+                            MCSPI_bus_unlock(client);
+                            DEBUG_NORM("%s: IOCTL: MCSPI_RESPONSE_START: %ld\n", DEVICE_NAME, err);
+                            return err;
+                          }
+                          break;
+
+
+    case MCSPI_RESPONSE_STOP :
+                          DEBUG_NORM("%s: IOCTL: MCSPI_RESPONSE_STOP\n", DEVICE_NAME);
+                          return MCSPI_response_stop(client);
+                          break;
+
+
+    case MCSPI_RESPONSE_STATS :
+                          return MCSPI_ioc_response_stats(client, (struct mcspi_ioc_response_stats __user *)arg);
+                          break;
+
+
+    case MCSPI_XFER_MODE_GET  :
+                          if(!access_ok(VERIFY_WRITE, (void __user *)arg, sizeof(u32)))
+                            return -EFAULT;
+                          put_user(mcspi->xfer_mode, (__u32 __user *)arg);
+                          DEBUG_NORM("%s: IOCTL: MCSPI_XFER_MODE requested\n", DEVICE_NAME);
+                          break;
+
     default: return -ENOTTY;
   }
 
@@ -39,29 +39,74 @@ inline void MCSPI_write_reg(void __iomem *base_addr,	u32 reg, u32 val)
 }
 
 
+/*
+The shadow of CHxCONF of the channel of dev. The setters only change the
+field in the shadow and mark it dirty if it really changed,
+MCSPI_regs_flush writes it out.
+*/
+static inline u32 *__chconf(struct MCSPI *dev)
+{
+  return &dev->regs->chconf[dev->channel_number];
+}
+
+static inline void __chconf_update(struct MCSPI *dev, u32 mask, u32 bits)
+{
+  u32 *val = __chconf(dev);
+  u32 new_val = (*val & ~mask) | bits;
+
+  if(new_val == *val)
+    return;
+  *val = new_val;
+  dev->regs->dirty |= MCSPI_REGS_DIRTY_CHCONF(dev->channel_number);
+}
+
+static inline void __modulctrl_update(struct MCSPI *dev, u32 mask, u32 bits)
+{
+  u32 new_val = (dev->regs->modulctrl & ~mask) | bits;
+
+  if(new_val == dev->regs->modulctrl)
+    return;
+  dev->regs->modulctrl = new_val;
+  dev->regs->dirty |= MCSPI_REGS_DIRTY_MODULCTRL;
+}
+
+//for the registers which have to change right away: shadow and register
+//together, no read back needed
+static inline void __chconf_write(struct MCSPI *dev)
+{
+  MCSPI_write_reg(dev->base_addr, MCSPI_CHCONF(dev->channel_number), *__chconf(dev));
+  dev->regs->dirty &= ~MCSPI_REGS_DIRTY_CHCONF(dev->channel_number);
+}
+
+static inline void __modulctrl_write(struct MCSPI *dev)
+{
+  MCSPI_write_reg(dev->base_addr, MCSPI_MODULCTRL, dev->regs->modulctrl);
+  dev->regs->dirty &= ~MCSPI_REGS_DIRTY_MODULCTRL;
+}
+
+
 /*
 core function for setting the TRM value of SPI module. Directly calling this is
 not advised. Call the MCSPI_mode_set() function instead
 */
-static void __set_tx_rx(struct MCSPI *dev, u32 channel_conf)
+static void __set_tx_rx(struct MCSPI *dev)
 {
-  u32 val;
-  val = MCSPI_read_reg(dev->base_addr, channel_conf);
-  val &= ~MCSPI_CHCONF_TRM(0x03);
+  u32 trm;
+
   switch(dev->tx_rx)
   {
     case MCSPI_CHCONF_TRM_RX:
-         val |= MCSPI_CHCONF_TRM(MCSPI_CHCONF_TRM_RX);
+         trm = MCSPI_CHCONF_TRM(MCSPI_CHCONF_TRM_RX);
          break;
     case MCSPI_CHCONF_TRM_TX:
-         val |= MCSPI_CHCONF_TRM(MCSPI_CHCONF_TRM_TX);
+         trm = MCSPI_CHCONF_TRM(MCSPI_CHCONF_TRM_TX);
          break;
     case MCSPI_CHCONF_TRM_TX_RX:
     default:
-         val |= MCSPI_CHCONF_TRM(MCSPI_CHCONF_TRM_TX_RX);
+         trm = MCSPI_CHCONF_TRM(MCSPI_CHCONF_TRM_TX_RX);
          break;
   }
-  MCSPI_write_reg(dev->base_addr, channel_conf, val);
+  __chconf_update(dev, MCSPI_CHCONF_TRM(0x03), trm);
 }
 
 /*
@@ -73,13 +118,17 @@ static inline void __set_clock(void __iomem *clock_base, u32 offset, bool enable
   u32 val;
 
   val = MCSPI_read_reg(clock_base, offset);
-  val &= CM_PER_SPI0_CLKCTRL_MODULEMODE(0x03);
+  val &= ~CM_PER_SPI0_CLKCTRL_MODULEMODE(0x03);
   if(enable)
     val |= CM_PER_SPI0_CLKCTRL_MODULEMODE(CM_PER_SPI0_CLKCTRL_MODULEMODE_ENABLE);
   else
     val |= CM_PER_SPI0_CLKCTRL_MODULEMODE(CM_PER_SPI0_CLKCTRL_MODULEMODE_DISABLE);
 
   MCSPI_write_reg(clock_base, offset, val);
+
+  //the registers can't be touched until the module is functional
+  if(enable && MCSPI_wait_for_bit_reset(clock_base + offset, CM_PER_SPI0_CLKCTRL_IDLEST(0x03), 10) < 0)
+    DEBUG_ALERT("%s: Clock: module not functional\n", DRIVER_NAME);
 }
 
 
@@ -185,72 +234,103 @@ int MCSPI_wait_for_bit_reset(void __iomem *addr, u32 bit, unsigned int timeout)
 }
 
 
+/*..............................................................................
+    @breif:      Time the given number of words take on the wire with the bit
+                 clock of dev (MCSPI_FCLK_HZ / MCSPI_clk_divider)
+    @parameters: dev: the device struct for the SPI module
+                 words: the number of words
+    @return:     the time in nanoseconds
+..............................................................................*/
+u64 MCSPI_xfer_time_ns(struct MCSPI *dev, u32 words)
+{
+  u64 bits = (u64)words * (dev->word_length + 1);
+
+  //counted in kHz so that a long message at the slowest clock still fits in
+  //64 bits
+  return div_u64(bits * MCSPI_clk_divider(dev) * USEC_PER_SEC, MCSPI_FCLK_HZ / 1000);
+}
+
+
+/*..............................................................................
+    @breif:      Timeout for a transfer of the given number of words: twice
+                 the expected time, at least 1 ms
+    @parameters: dev: the device struct for the SPI module
+                 words: the number of words
+    @return:     the timeout in milliseconds
+..............................................................................*/
+unsigned int MCSPI_xfer_timeout_ms(struct MCSPI *dev, u32 words)
+{
+  return div_u64(2 * MCSPI_xfer_time_ns(dev, words), NSEC_PER_MSEC) + 1;
+}
 
 
 /*..............................................................................
-    @breif:      Sets the SPI mode MASTER or SLAVE
+    @breif:      Same as MCSPI_wait_for_bit_set, but when the bit is expected
+                 to take a while it sleeps until shortly before then and only
+                 spins for the rest. Process context only
+    @parameters: addr: The register address to look for
+                 bit:  the bit for which we are supposed to wait
+                 expect_ns: when the bit is expected to set, from now
+                 timeout: timeout in milliseconds
+    @return:     0 on success; -1 on error
+..............................................................................*/
+int MCSPI_wait_for_bit_set_sleep(void __iomem *addr, u32 bit, u64 expect_ns, unsigned int timeout)
+{
+  unsigned long sleep_us;
+
+  if(expect_ns >= MCSPI_SLEEP_MIN_NS && !(ioread32(addr) & bit))
+  {
+    //wake up a little early rather than late, the spin below does the rest
+    sleep_us = div_u64(expect_ns - MCSPI_SPIN_MARGIN_NS, NSEC_PER_USEC);
+    usleep_range(sleep_us - sleep_us/8, sleep_us);
+  }
+
+  return MCSPI_wait_for_bit_set(addr, bit, timeout);
+}
+
+
+
+
+/*..............................................................................
+    @breif:      Sets the SPI mode MASTER or SLAVE and whether the CS is used
+                 (module wide, for all the channels)
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
 void MCSPI_mode_set(struct MCSPI *dev)
 {
-  u32 val=0;
   //Check for validity of the mode. If invalid do nothing
   if(dev->role == MCSPI_MODULCTRL_MASTER  ||  dev->role == MCSPI_MODULCTRL_SLAVE)
-  {
-    val = MCSPI_read_reg(dev->base_addr, MCSPI_MODULCTRL);
-    val &= ~MCSPI_MODULCTRL_MS(1);
-    val |= MCSPI_MODULCTRL_MS(dev->role);
-    MCSPI_write_reg(dev->base_addr, MCSPI_MODULCTRL, val);
-
-    /*
-    val = MCSPI_read_reg(dev->base_addr, MCSPI_MODULCTRL);
-    if( ( (val & 1<<2)>>2) == MCSPI_MODULCTRL_MASTER)
-      DEBUG_NORM("MASTER_MODE\n");
-    else
-     DEBUG_NORM("SLAVE_MODE\n");
-     */
-  }
-
-  switch(dev->channel_number)
-  {
-    default:
-    case 0: __set_tx_rx(dev, MCSPI_CH0CONF);  break;
-    case 1: __set_tx_rx(dev, MCSPI_CH1CONF);  break;
-    case 2: __set_tx_rx(dev, MCSPI_CH2CONF);  break;
-    case 3: __set_tx_rx(dev, MCSPI_CH3CONF);  break;
-  }
+    __modulctrl_update(dev, MCSPI_MODULCTRL_MS(1), MCSPI_MODULCTRL_MS(dev->role));
 
+	if (dev->CS_sensitive == MCSPI_CS_SENSITIVE_ENABLED)
+		__modulctrl_update(dev, MCSPI_MODULCTRL_PIN34(1), 0);
+	else if(dev->CS_sensitive == MCSPI_CS_SENSITIVE_DISABLED)
+		__modulctrl_update(dev, MCSPI_MODULCTRL_PIN34(1), MCSPI_MODULCTRL_PIN34(1));
 
   return;
 }
 
 
 /*..............................................................................
-    @breif:      Sets the SPI word length for transfer
+    @breif:      Sets the transmit/receive mode of the channel
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
-void MCSPI_wl_set(struct MCSPI *dev)
+void MCSPI_trm_set(struct MCSPI *dev)
 {
-  u32 val;
-  u32 channel_conf = 0;
-
-  switch(dev->channel_number)
-  {
-    default:
-    case 0: channel_conf = MCSPI_CH0CONF;   break;
-    case 1: channel_conf = MCSPI_CH1CONF;   break;
-    case 2: channel_conf = MCSPI_CH2CONF;   break;
-    case 3: channel_conf = MCSPI_CH3CONF;   break;
-  }
-
-  val = MCSPI_read_reg(dev->base_addr, channel_conf);
+  __set_tx_rx(dev);
+}
 
-  val &= ~MCSPI_CHCONF_WL(0x1F);
-  val |= MCSPI_CHCONF_WL(dev->word_length);
 
-  MCSPI_write_reg(dev->base_addr, channel_conf, val);
+/*..............................................................................
+    @breif:      Sets the SPI word length for transfer
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_wl_set(struct MCSPI *dev)
+{
+  __chconf_update(dev, MCSPI_CHCONF_WL(0x1F), MCSPI_CHCONF_WL(dev->word_length));
 }
 
 
@@ -261,35 +341,18 @@ void MCSPI_wl_set(struct MCSPI *dev)
 ..............................................................................*/
 void MCSPI_pol_pha_set(struct MCSPI *dev)
 {
-  u32 val=0;
-  u32 channel_conf;
+  u32 mask = MCSPI_CHCONF_IS(1) | MCSPI_CHCONF_DPE1(1) | MCSPI_CHCONF_DPE0(1) |
+             MCSPI_CHCONF_POL(1) | MCSPI_CHCONF_PHA(1);
+  u32 bits;
 
-  u32 pin_dir = 0xFFFFFFFF;
+  if (dev->pin_direction == MCSPI_D0_IN_D1_OUT)
+		bits = MCSPI_CHCONF_DPE0(1);
+	else
+		bits = MCSPI_CHCONF_IS(1) | MCSPI_CHCONF_DPE1(1);
 
-  if (dev->pin_direction == MCSPI_D0_IN_D1_OUT) {
-		pin_dir &= ~MCSPI_CHCONF_IS(1);
-		pin_dir &= ~MCSPI_CHCONF_DPE1(1);
-		pin_dir |= MCSPI_CHCONF_DPE0(1);
-	} else {
-		pin_dir |= MCSPI_CHCONF_IS(1);
-		pin_dir |= MCSPI_CHCONF_DPE1(1);
-		pin_dir &= ~MCSPI_CHCONF_DPE0(1);
-  }
-
-  switch(dev->channel_number)
-  {
-    default:
-    case 0: channel_conf = MCSPI_CH0CONF;  break;
-    case 1: channel_conf = MCSPI_CH1CONF;  break;
-    case 2: channel_conf = MCSPI_CH2CONF;  break;
-    case 3: channel_conf = MCSPI_CH3CONF;  break;
-  }
-
-  val = MCSPI_read_reg(dev->base_addr, channel_conf);
-  val &= ~MCSPI_CHCONF_POL(1) & ~MCSPI_CHCONF_PHA(1);
-  val |= MCSPI_CHCONF_POL((bool)dev->polarity) | MCSPI_CHCONF_PHA((bool)dev->phase);
-  MCSPI_write_reg(dev->base_addr, channel_conf, val & pin_dir);
+  bits |= MCSPI_CHCONF_POL((bool)dev->polarity) | MCSPI_CHCONF_PHA((bool)dev->phase);
 
+  __chconf_update(dev, mask, bits);
   return;
 }
 
@@ -302,26 +365,17 @@ void MCSPI_pol_pha_set(struct MCSPI *dev)
 ..............................................................................*/
 void MCSPI_enable(struct MCSPI *dev, u8 enable)
 {
-  u32 val;
+  u32 extclk = 0;
 
-  switch(dev->channel_number)
-  {
-    case 0: val = MCSPI_read_reg(dev->base_addr, MCSPI_CH0CTRL);
-            MCSPI_write_reg(dev->base_addr, MCSPI_CH0CTRL, MCSPI_CHCTRL_EN(enable));
-            break;
-    case 1: val = MCSPI_read_reg(dev->base_addr, MCSPI_CH1CTRL);
-            MCSPI_write_reg(dev->base_addr, MCSPI_CH1CTRL, MCSPI_CHCTRL_EN(enable));
-            break;
-    case 2: val = MCSPI_read_reg(dev->base_addr, MCSPI_CH2CTRL);
-            MCSPI_write_reg(dev->base_addr, MCSPI_CH2CTRL, MCSPI_CHCTRL_EN(enable));
-            break;
-    case 3: val = MCSPI_read_reg(dev->base_addr, MCSPI_CH3CTRL);
-            MCSPI_write_reg(dev->base_addr, MCSPI_CH3CTRL, MCSPI_CHCTRL_EN(enable));
-            break;
-
-    default:  DEBUG_ALERT("%s: Enable: Incorrect Channel Number\n",DRIVER_NAME);
-              break;
-  }
+  //the upper bits of the CLKG divider live in CHCTRL, next to EN
+  if(dev->speed_hz && dev->role == MCSPI_MODULCTRL_MASTER)
+    extclk = (MCSPI_clk_divider(dev) - 1) >> 4;
+
+  if(dev->channel_number >= 0 && dev->channel_number < MCSPI_NUM_CHANNELS)
+    MCSPI_write_reg(dev->base_addr, MCSPI_CHCTRL(dev->channel_number),
+                    MCSPI_CHCTRL_EN(enable) | MCSPI_CHCTRL_EXTCLK(extclk));
+  else
+    DEBUG_ALERT("%s: Enable: Incorrect Channel Number\n",DRIVER_NAME);
 }
 
 
@@ -333,137 +387,440 @@ void MCSPI_enable(struct MCSPI *dev, u8 enable)
 ..............................................................................*/
 void MCSPI_reset(struct MCSPI *dev)
 {
+  int ch;
+
   MCSPI_set_bit(dev->base_addr + MCSPI_SYSCONFIG, 0x02);
   if( MCSPI_wait_for_bit_set(dev->base_addr + MCSPI_SYSSTATUS, 0x01, 100) <0 )
     DEBUG_ALERT("%s: Reset: timout\n", DRIVER_NAME);
+
+  //the only time the configuration registers are read: the shadows start
+  //from the reset values
+  dev->regs->modulctrl = MCSPI_read_reg(dev->base_addr, MCSPI_MODULCTRL);
+  for(ch = 0 ; ch < MCSPI_NUM_CHANNELS ; ch++)
+    dev->regs->chconf[ch] = MCSPI_read_reg(dev->base_addr, MCSPI_CHCONF(ch));
+  dev->regs->dirty = 0;
+}
+
+
+/*..............................................................................
+    @breif:      Loads whole precomputed MODULCTRL/CHxCONF words into the
+                 shadows, marking dirty only what differs
+    @parameters: dev: the device struct for the SPI module
+                 modulctrl: the MODULCTRL word
+                 chconf: the CHxCONF word of the channel of dev
+    @return:     void
+..............................................................................*/
+void MCSPI_regs_load(struct MCSPI *dev, u32 modulctrl, u32 chconf)
+{
+  __modulctrl_update(dev, 0xFFFFFFFF, modulctrl);
+  __chconf_update(dev, 0xFFFFFFFF, chconf);
+}
+
+
+/*..............................................................................
+    @breif:      Writes all the shadow registers back, e.g. after the clock was
+                 gated and the module may have lost its context
+    @parameters: base_addr: the base address of the MCSPI registers
+                 regs: the shadows
+    @return:     void
+..............................................................................*/
+void MCSPI_regs_restore(void __iomem *base_addr, struct MCSPI_regs *regs)
+{
+  int ch;
+
+  MCSPI_write_reg(base_addr, MCSPI_MODULCTRL, regs->modulctrl);
+  for(ch = 0 ; ch < MCSPI_NUM_CHANNELS ; ch++)
+    MCSPI_write_reg(base_addr, MCSPI_CHCONF(ch), regs->chconf[ch]);
+
+  regs->dirty = 0;
 }
 
 
 /*..............................................................................
-    @breif:      Chip select polarity and pin_selection
+    @breif:      Writes the shadow registers changed since the last flush, each
+                 of them once
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_regs_flush(struct MCSPI *dev)
+{
+  int ch;
+
+  if(dev->regs->dirty & MCSPI_REGS_DIRTY_MODULCTRL)
+    MCSPI_write_reg(dev->base_addr, MCSPI_MODULCTRL, dev->regs->modulctrl);
+
+  for(ch = 0 ; ch < MCSPI_NUM_CHANNELS ; ch++)
+    if(dev->regs->dirty & MCSPI_REGS_DIRTY_CHCONF(ch))
+      MCSPI_write_reg(dev->base_addr, MCSPI_CHCONF(ch), dev->regs->chconf[ch]);
+
+  dev->regs->dirty = 0;
+}
+
+
+/*..............................................................................
+    @breif:      Chip select polarity of the channel
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
 void MCSPI_Set_CS(struct MCSPI *dev)
 {
-	u32 val;
-  u32 channel_conf;
+  if (dev->CS_polarity == MCSPI_CS_ACTIVE_LOW)
+    __chconf_update(dev, MCSPI_CHCONF_EPOL(1), MCSPI_CHCONF_EPOL(1));
+  else
+    __chconf_update(dev, MCSPI_CHCONF_EPOL(1), 0);
+}
+
+
+/*..............................................................................
+    @breif:      Set Clock divider: the power of two clock_div, or with
+                 speed_hz set the one clock granularity divider for it (the
+                 upper bits of which go to CHCTRL with MCSPI_enable)
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_Set_CLKD(struct MCSPI *dev)
+{
+  u32 mask = MCSPI_CHCONF_CLKD(0x0F) | MCSPI_CHCONF_CLKG(1);
 
-  switch(dev->channel_number)
+  //the channel is disabled by MCSPI_configure_channel while the shadow is
+  //flushed
+  if(dev->role == MCSPI_MODULCTRL_MASTER)
   {
-    default:
-    case 0: channel_conf = MCSPI_CH0CONF;  break;
-    case 1: channel_conf = MCSPI_CH1CONF;  break;
-    case 2: channel_conf = MCSPI_CH2CONF;  break;
-    case 3: channel_conf = MCSPI_CH3CONF;  break;
+    if(dev->speed_hz)
+      __chconf_update(dev, mask, MCSPI_CHCONF_CLKG(1) |
+                                 MCSPI_CHCONF_CLKD((MCSPI_clk_divider(dev) - 1) & 0x0F));
+    else if(dev->clock_div >= CLK_1  && dev->clock_div <=CLK_32768)
+      __chconf_update(dev, mask, MCSPI_CHCONF_CLKD(dev->clock_div));
   }
+}
 
-  val = MCSPI_read_reg(dev->base_addr, channel_conf);
-  if (dev->CS_polarity == MCSPI_CS_ACTIVE_LOW)
-    val |= MCSPI_CHCONF_EPOL(1);
+
+/*..............................................................................
+    @breif:      Picks the clock for a maximum speed: the one clock granularity
+                 divider of the fastest clock not above hz, or for speeds below
+                 what it reaches the power of two divider that gets under hz.
+                 Only sets dev->speed_hz/clock_div, MCSPI_Set_CLKD writes it
+    @parameters: dev: the device struct for the SPI module
+                 hz: the maximum speed, 0 to go back to dev->clock_div
+    @return:     0; -EINVAL if even the slowest clock is faster than hz (dev
+                 is left as it was)
+..............................................................................*/
+int MCSPI_speed_set(struct MCSPI *dev, u32 hz)
+{
+  u32 div;
+  unsigned int clock_div;
+
+  if(!hz)
+  {
+    dev->speed_hz = 0;
+    return 0;
+  }
+
+  div = DIV_ROUND_UP(MCSPI_FCLK_HZ, hz);
+  if(div <= MCSPI_CLKG_DIV_MAX)
+  {
+    dev->speed_hz = hz;
+    return 0;
+  }
+
+  for(clock_div = CLK_1 ; (1U << clock_div) < div && clock_div < CLK_32768 ; clock_div++)
+    ;
+  if((1U << clock_div) < div)
+    return -EINVAL;
+
+  dev->speed_hz = 0;
+  dev->clock_div = clock_div;
+  return 0;
+}
+
+
+/*..............................................................................
+    @breif:      The divider of MCSPI_FCLK_HZ the bit clock of dev runs at
+    @parameters: dev: the device struct for the SPI module
+    @return:     the divider, 1 to 32768
+..............................................................................*/
+u32 MCSPI_clk_divider(struct MCSPI *dev)
+{
+  if(dev->speed_hz)
+    return clamp_t(u32, DIV_ROUND_UP(MCSPI_FCLK_HZ, dev->speed_hz), 1, MCSPI_CLKG_DIV_MAX);
+
+  return 1U << dev->clock_div;
+}
+
+
+/*..............................................................................
+    @breif:      Enables/disables the TX (and RX) FIFO of the channel and sets
+                 the almost-empty/almost-full levels. Channel must be disabled
+    @parameters: dev: the device struct for the SPI module
+                 enable: can be 0/1 for disable/enable
+    @return:     void
+..............................................................................*/
+void MCSPI_fifo_set(struct MCSPI *dev, u8 enable)
+{
+  u32 bits = 0;
+
+  //receive only transfers are still done word by word, so no FIFO for them
+  if(enable && dev->tx_rx != MCSPI_CHCONF_TRM_RX)
+  {
+    bits |= MCSPI_CHCONF_FFEW(1);
+    if(dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX)
+      bits |= MCSPI_CHCONF_FFER(1);
+  }
+
+  __chconf_update(dev, MCSPI_CHCONF_FFEW(1) | MCSPI_CHCONF_FFER(1), bits);
+}
+
+
+/*..............................................................................
+    @breif:      Sets the almost-empty/almost-full levels of the FIFO to a
+                 chunk, with no word count (MCSPI_XFER_MODE_FIFO)
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_fifo_levels_set(struct MCSPI *dev)
+{
+  //TX_EMPTY fires when a chunk can be written, RX_FULL when a chunk can be read
+  MCSPI_write_reg(dev->base_addr, MCSPI_XFERLEVEL,
+                  MCSPI_XFERLEVEL_AEL(MCSPI_FIFO_CHUNK - 1) |
+                  MCSPI_XFERLEVEL_AFL(MCSPI_FIFO_CHUNK - 1));
+}
+
+
+/*..............................................................................
+    @breif:      Switches the channel to a one way slave setup and back: receive
+                 (capture) or transmit (responses) only, with just the FIFO of
+                 that direction (which then gets all of the FIFO memory), or
+                 the TRM/FIFO settings of dev again. Written out straight away.
+                 Channel must be disabled
+    @parameters: dev: the device struct for the SPI module
+                 enable: 1 for the one way setup, 0 to go back
+                 tx_rx: MCSPI_CHCONF_TRM_RX or MCSPI_CHCONF_TRM_TX
+    @return:     void
+..............................................................................*/
+void MCSPI_slave_fifo_set(struct MCSPI *dev, u8 enable, unsigned int tx_rx)
+{
+  if(enable)
+    __chconf_update(dev, MCSPI_CHCONF_TRM(0x03) | MCSPI_CHCONF_FFEW(1) | MCSPI_CHCONF_FFER(1),
+                    MCSPI_CHCONF_TRM(tx_rx) |
+                    (tx_rx == MCSPI_CHCONF_TRM_TX ? MCSPI_CHCONF_FFEW(1) : MCSPI_CHCONF_FFER(1)));
   else
-    val &= ~MCSPI_CHCONF_EPOL(1);
-  MCSPI_write_reg(dev->base_addr, channel_conf, val);
+  {
+    __set_tx_rx(dev);
+    MCSPI_fifo_set(dev, dev->xfer_mode != MCSPI_XFER_MODE_POLL);
+  }
 
+  MCSPI_regs_flush(dev);
+}
 
-	val = MCSPI_read_reg(dev->base_addr, MCSPI_MODULCTRL);
-	if (dev->CS_sensitive == MCSPI_CS_SENSITIVE_ENABLED)
-		val &= ~MCSPI_MODULCTRL_PIN34(1);
-	else if(dev->CS_sensitive == MCSPI_CS_SENSITIVE_DISABLED)
-		val |= MCSPI_MODULCTRL_PIN34(1);
-	MCSPI_write_reg(dev->base_addr, MCSPI_MODULCTRL, val);
+
+/*..............................................................................
+    @breif:      Switches a channel off and takes the FIFO and the DMA
+                 requests away from it, before another channel gets the bus
+    @parameters: base_addr: the base address of the MCSPI registers
+                 ch: the channel (0-3)
+    @return:     void
+..............................................................................*/
+void MCSPI_channel_release(struct MCSPI *dev, int ch)
+{
+  u32 *val = &dev->regs->chconf[ch];
+
+  MCSPI_write_reg(dev->base_addr, MCSPI_CHCTRL(ch), MCSPI_CHCTRL_EN(0));
+
+  *val &= ~(MCSPI_CHCONF_FFEW(1) | MCSPI_CHCONF_FFER(1) |
+            MCSPI_CHCONF_DMAW(1) | MCSPI_CHCONF_DMAR(1));
+  MCSPI_write_reg(dev->base_addr, MCSPI_CHCONF(ch), *val);
+  dev->regs->dirty &= ~MCSPI_REGS_DIRTY_CHCONF(ch);
 }
 
 
 /*..............................................................................
-    @breif:      Set Clock divider
+    @breif:      Holds the CS of the channel asserted (FORCE) across words and
+                 transfers, or lets it go again. Master mode only, the module
+                 is put in single channel mode for it
     @parameters: dev: the device struct for the SPI module
+                 force: 1 to assert and hold the CS, 0 to release it
     @return:     void
 ..............................................................................*/
-void MCSPI_Set_CLKD(struct MCSPI *dev)
+void MCSPI_cs_force(struct MCSPI *dev, u8 force)
 {
-  u32 val;
-  u32 restore;
-  u32 channel_conf;
+  u32 *val = __chconf(dev);
 
-  switch(dev->channel_number)
+  //FORCE only works in single channel mode, so SINGLE goes on first and
+  //comes off last
+  if(force)
   {
-    default:
-    case 0: channel_conf = MCSPI_CH0CONF;  break;
-    case 1: channel_conf = MCSPI_CH1CONF;  break;
-    case 2: channel_conf = MCSPI_CH2CONF;  break;
-    case 3: channel_conf = MCSPI_CH3CONF;  break;
+    dev->regs->modulctrl |= MCSPI_MODULCTRL_SINGLE(1);
+    __modulctrl_write(dev);
   }
 
-  if(dev->role == MCSPI_MODULCTRL_MASTER)
+  *val &= ~MCSPI_CHCONF_FORCE(1);
+  if(force)
+    *val |= MCSPI_CHCONF_FORCE(1);
+  __chconf_write(dev);
+
+  if(!force)
   {
-    if(dev->clock_div >= CLK_1  && dev->clock_div <=CLK_32768)
-    {
-      restore = MCSPI_read_reg(dev->base_addr, channel_conf);
-      restore = restore & MCSPI_CHCTRL_EN(1);
-      restore = restore ? 1 : 0;
+    dev->regs->modulctrl &= ~MCSPI_MODULCTRL_SINGLE(1);
+    __modulctrl_write(dev);
+  }
+}
+
+
+/*..............................................................................
+    @breif:      Turns TURBO of the channel on/off: no idle cycles between the
+                 words of a multi word transfer. Only has an effect in single
+                 channel mode (see MCSPI_cs_force). Channel must be disabled
+    @parameters: dev: the device struct for the SPI module
+                 enable: can be 0/1 for disable/enable
+    @return:     void
+..............................................................................*/
+void MCSPI_turbo_set(struct MCSPI *dev, u8 enable)
+{
+  u32 *val = __chconf(dev);
+
+  *val &= ~MCSPI_CHCONF_TURBO(1);
+  if(enable)
+    *val |= MCSPI_CHCONF_TURBO(1);
+  __chconf_write(dev);
+}
+
+
+/*..............................................................................
+    @breif:      Enables/disables the DMA requests of the channel and switches
+                 the FIFO over to the DMA aligned DAFTX/DAFRX registers
+    @parameters: dev: the device struct for the SPI module
+                 enable: can be 0/1 for disable/enable
+    @return:     void
+..............................................................................*/
+void MCSPI_dma_set(struct MCSPI *dev, u8 enable)
+{
+  u32 *val = __chconf(dev);
+
+  dev->regs->modulctrl &= ~MCSPI_MODULCTRL_FDAA(1);
+  if(enable)
+    dev->regs->modulctrl |= MCSPI_MODULCTRL_FDAA(1);
+  __modulctrl_write(dev);
 
-      //Disable the device before changing the clock frequency
-      MCSPI_enable(dev, 0);
+  *val &= ~(MCSPI_CHCONF_DMAW(1) | MCSPI_CHCONF_DMAR(1));
+  if(enable)
+  {
+    *val |= MCSPI_CHCONF_DMAW(1);
+    if(dev->tx_rx == MCSPI_CHCONF_TRM_TX_RX)
+      *val |= MCSPI_CHCONF_DMAR(1);
+  }
+  __chconf_write(dev);
+}
 
-      val = MCSPI_read_reg(dev->base_addr, channel_conf);
-      val &= ~MCSPI_CHCONF_CLKD(dev->clock_div);
-      val |= MCSPI_CHCONF_CLKD(dev->clock_div);
 
-      MCSPI_write_reg(dev->base_addr, channel_conf, val);
+/*..............................................................................
+    @breif:      Finds the DT node of a McSPI (there for spi-omap2-mcspi) by the
+                 address of its registers. Its interrupts and dmas are in the
+                 terms of the INTC/EDMA, this driver maps them from there
+    @parameters: start: physical address of the McSPI registers
+    @return:     the node, with a reference (of_node_put it); NULL if none
+..............................................................................*/
+struct device_node *MCSPI_of_node(resource_size_t start)
+{
+  static const char * const compatible[] = { "ti,omap4-mcspi", "ti,omap2-mcspi" };
+  struct device_node *np;
+  struct resource res;
+  int i;
 
-      //restore the status of the SPI driver.
-      MCSPI_enable(dev, restore);
+  for(i = 0 ; i < ARRAY_SIZE(compatible) ; i++)
+  {
+    for_each_compatible_node(np, NULL, compatible[i])
+    {
+      //the iterator drops the reference of the node it moves past only
+      if(!of_address_to_resource(np, 0, &res) && res.start == start)
+        return np;
     }
   }
+  return NULL;
 }
 
 
-/** @brief The IRQ handler for the MCSPI controller
+/** @brief The IRQ handler for the MCSPI controller. TX_EMPTY tops up the TX
+ *         FIFO by a chunk, RX_FULL drains a chunk from the RX FIFO and EOW
+ *         (the word count is done) picks up the last words and completes the
+ *         transfer.
  *  @param irq: the IRQ numer which called this handler
- *         dev_id: pointer to temp_struct
- *  @param filep A pointer to a file object (defined in linux/fs.h)
+ *         dev_id: pointer to the struct MCSPI_data
  */
 irq_handler_t MCSPI_irq_handler(unsigned int irq, void *dev_id)
 {
   struct MCSPI_data *mcspi_data = (struct MCSPI_data *)dev_id;
-  struct MCSPI *mcspi = (struct MCSPI *)mcspi_data->device;
-
+  struct MCSPI_xfer *xfer = &mcspi_data->xfer;
+  struct MCSPI *mcspi;
+  u32 tx_empty, rx_full;
   u32 val;
+  int i, ch;
+
+  //a slave capture/response mode has the IRQ to itself until it is stopped
+  if(mcspi_data->capture.client)
+    return MCSPI_capture_irq(mcspi_data);
+  if(mcspi_data->responder)
+    return MCSPI_response_irq(mcspi_data);
+
+  //no transfer of MCSPI_send_data_irq running (or no client on the bus)
+  mcspi = mcspi_data->device;
+  if(!mcspi || !xfer->irq_enabled)
+    return (irq_handler_t) IRQ_NONE;
 
-  switch(mcspi->channel_number)
+  ch = mcspi->channel_number;
+  tx_empty = MCSPI_IRQ_TX_EMPTY_MASK(ch);
+  rx_full = MCSPI_IRQ_RX_FULL_MASK(ch);
+
+  val = MCSPI_read_reg(mcspi->base_addr, MCSPI_IRQSTATUS) & xfer->irq_enabled;
+  if(!val)
+    return (irq_handler_t) IRQ_NONE;
+
+  MCSPI_write_reg(mcspi->base_addr, MCSPI_IRQSTATUS, val);
+
+  if(val & rx_full)
   {
-    case 0:  val = MCSPI_read_reg(mcspi->base_addr, MCSPI_CH0STAT);
-             if(val & MCSPI_CHSTAT_EOT_MASK)
-             {
-               DEBUG_NORM("%s: IRQ: ch 0 EOT set\n", DRIVER_NAME);
-             }
-             break;
-
-    case 1:  val = MCSPI_read_reg(mcspi->base_addr, MCSPI_CH1STAT);
-             if(val & MCSPI_CHSTAT_EOT_MASK)
-             {
-               DEBUG_NORM("%s: IRQ: ch 1 EOT set\n", DRIVER_NAME);
-             }
-             break;
-
-    case 2:  val = MCSPI_read_reg(mcspi->base_addr, MCSPI_CH2STAT);
-             if(val & MCSPI_CHSTAT_EOT_MASK)
-             {
-               DEBUG_NORM("%s: IRQ: ch 2 EOT set\n", DRIVER_NAME);
-             }
-             break;
-
-    case 3:  val = MCSPI_read_reg(mcspi->base_addr, MCSPI_CH3STAT);
-             if(val & MCSPI_CHSTAT_EOT_MASK)
-             {
-               DEBUG_NORM("%s: IRQ: ch 3 EOT set\n", DRIVER_NAME);
-             }
-             break;
-
-    default: DEBUG_ALERT("%s: IRQ: incorrect channel number\n", DRIVER_NAME);
-             break;
+    for(i = 0 ; i < xfer->chunk && xfer->rx_count < xfer->words ; i++, xfer->rx_count++)
+      __put_word(xfer->buf, xfer->rx_count, xfer->wl_bytes,
+                 MCSPI_read_reg(mcspi->base_addr, MCSPI_RX(ch)));
+
+    //RX caught up, let the TX side run again
+    if(xfer->tx_count < xfer->words)
+      xfer->irq_enabled |= tx_empty;
   }
 
+  if(val & tx_empty)
+  {
+    for(i = 0 ; i < xfer->chunk && xfer->tx_count < xfer->words ; i++, xfer->tx_count++)
+      MCSPI_write_reg(mcspi->base_addr, MCSPI_TX(ch),
+                      __get_word(xfer->buf, xfer->tx_count, xfer->wl_bytes));
+
+    //nothing left to send, or the RX FIFO would overflow if we sent more
+    if(xfer->tx_count == xfer->words ||
+       (xfer->rx && xfer->tx_count - xfer->rx_count > xfer->chunk))
+      xfer->irq_enabled &= ~tx_empty;
+  }
+
+  if(val & MCSPI_IRQ_EOW)
+  {
+    DEBUG_NORM("%s: IRQ: ch %d EOW set\n", DRIVER_NAME, ch);
+
+    //EOW is the word count reaching WCNT, the last word may still be
+    //shifting: wait for EOT (a word or two at most, jiffies don't move in
+    //here) before the rest is picked up from the RX FIFO, as the bulk mode does
+    for(i = 0 ; i < xfer->eot_us &&
+        !(MCSPI_read_reg(mcspi->base_addr, MCSPI_CHSTAT(ch)) & MCSPI_CHSTAT_EOT_MASK) ; i++)
+      udelay(1);
+
+    while(xfer->rx && xfer->rx_count < xfer->words &&
+          !(MCSPI_read_reg(mcspi->base_addr, MCSPI_CHSTAT(ch)) & MCSPI_CHSTAT_RXFFE_MASK))
+      __put_word(xfer->buf, xfer->rx_count++, xfer->wl_bytes,
+                 MCSPI_read_reg(mcspi->base_addr, MCSPI_RX(ch)));
+
+    xfer->irq_enabled = 0;
+    xfer->status = (xfer->rx && xfer->rx_count < xfer->words) ? -EIO : 0;
+    complete(&xfer->done);
+  }
+
+  MCSPI_write_reg(mcspi->base_addr, MCSPI_IRQENABLE, xfer->irq_enabled);
+
   return (irq_handler_t) IRQ_HANDLED;
 }
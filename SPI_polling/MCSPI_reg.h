@@ -21,11 +21,12 @@
 #include <linux/io.h>
 #include <linux/pm_runtime.h>
 #include <linux/of_irq.h>
+#include <linux/of_address.h>
+#include <linux/irqdomain.h>
 #include <linux/interrupt.h>
 #include <linux/uaccess.h>
 
 #include "my_gpio.h"         //for BIT() macro
-#include "MCSPI_misc.h"
 #include "cm_per.h"          //for enabling the clock to SPI0 module
 
 
@@ -40,11 +41,14 @@
 #define MCSPI0_BASE          MCSPI0_START
 #define MCSPI0_ADDR_SIZE     MCSPI0_END - MCSPI0_START
 
+#define MCSPI0_IRQ           65   //SPI0INT on the AM335x interrupt controller (hwirq)
+
 //  -- MCSPI1 address space --
 #define MCSPI1_START         0x481A0000
 #define MCSPI1_END           0x481A0FFF
 #define MCSPI1_BASE          MCSPI1_START
 #define MCSPI1_ADDR_SIZE     MCSPI1_END - MCSPI1_START
+#define MCSPI1_IRQ           125  //SPI1INT on the AM335x interrupt controller (hwirq)
 
 // -- Register offsets --
 #define MCSPI_REVISION       0x000 //McSPI revision register
@@ -78,6 +82,16 @@
 #define MCSPI_DAFTX          0x180 //McSPI DMA address aligned FIFO tx register
 #define MCSPI_DAFRX          0x1A0 //McSPI DMA address aligned FIFO rx register
 
+// -- Per channel register offsets (channel n is n*0x14 above channel 0) --
+#define MCSPI_CH_STRIDE      0x14
+#define MCSPI_NUM_CHANNELS   4     //one chip select each
+#define MCSPI_NUM_PROFILES   8     //per open file, see MCSPI_PROFILE_SET
+#define MCSPI_CHCONF(ch)     (MCSPI_CH0CONF + (ch)*MCSPI_CH_STRIDE)
+#define MCSPI_CHSTAT(ch)     (MCSPI_CH0STAT + (ch)*MCSPI_CH_STRIDE)
+#define MCSPI_CHCTRL(ch)     (MCSPI_CH0CTRL + (ch)*MCSPI_CH_STRIDE)
+#define MCSPI_TX(ch)         (MCSPI_TX0 + (ch)*MCSPI_CH_STRIDE)
+#define MCSPI_RX(ch)         (MCSPI_RX0 + (ch)*MCSPI_CH_STRIDE)
+
 
 //--------------------  SYSCONFIG -------------------------
 #define MCSPI_SYSCONFIG_CLOCKACTIVITY(val)		(0x03 << 8)
@@ -91,6 +105,7 @@
 
 
 //-------------------- MODULCTRL -------------------------
+#define MCSPI_MODULCTRL_SINGLE(val)       (val << 0)
 #define MCSPI_MODULCTRL_PIN34(val)        (val << 1)
 #define MCSPI_CS_SENSITIVE_DISABLED       0x00UL
 #define MCSPI_CS_SENSITIVE_ENABLED        0x01UL
@@ -112,6 +127,7 @@
 
 //---------------------- CHCTRL --------------------------
 #define MCSPI_CHCTRL_EN(val)              (val << 0)
+#define MCSPI_CHCTRL_EXTCLK(val)          (val << 8)     //CLKG divider bits 11:4
 
 
 //---------------------- CHCONF --------------------------
@@ -146,17 +162,24 @@
 #define MCSPI_CHCONF_WL_8BIT              0x07UL
 #define MCSPI_CHCONF_WL_16BIT             0x0FUL
 #define MCSPI_CHCONF_WL_32BIT             0x1FUL
+//bytes taken by one word in the (packed) user buffer
+#define MCSPI_CHCONF_WL_BYTES(wl)         ((wl) < 8 ? 1 : ((wl) < 16 ? 2 : 4))
 
 #define MCSPI_CHCONF_TRM(val)             (val << 12)
 #define MCSPI_CHCONF_TRM_TX               0x02UL
 #define MCSPI_CHCONF_TRM_RX               0x01UL
 #define MCSPI_CHCONF_TRM_TX_RX            0x00UL
 
+#define MCSPI_CHCONF_DMAW(val)            (val << 14)
+#define MCSPI_CHCONF_DMAR(val)            (val << 15)
 #define MCSPI_CHCONF_DPE0(val)			      (val << 16)
 #define MCSPI_CHCONF_DPE1(val)			      (val << 17)
 #define MCSPI_CHCONF_IS(val)              (val << 18)
+#define MCSPI_CHCONF_TURBO(val)           (val << 19)
+#define MCSPI_CHCONF_FORCE(val)           (val << 20)
 #define MCSPI_CHCONF_FFEW(val)            (val << 27)
 #define MCSPI_CHCONF_FFER(val)            (val << 28)
+#define MCSPI_CHCONF_CLKG(val)            (val << 29)    //1: divider EXTCLK.CLKD + 1
 
 #define MCSPI_D0_IN_D1_OUT                0x00UL
 #define MCSPI_D1_IN_D0_OUT                0x01UL
@@ -180,6 +203,10 @@
 #define MCSPI_IRQ_RX0_FULL_MASK           BIT(2)
 #define MCSPI_IRQ_RX0_OVERFLOW_MASK       BIT(3)
 
+#define MCSPI_IRQ_TX_EMPTY_MASK(ch)       BIT((ch)*4)
+#define MCSPI_IRQ_TX_UNDERFLOW_MASK(ch)   BIT((ch)*4 + 1)
+#define MCSPI_IRQ_RX_FULL_MASK(ch)        BIT((ch)*4 + 2)
+
 #define MCSPI_IRQ_EOW                     BIT(17)
 
 #define MCSPI_IRQ_RESET				0xFFFFFFFF
@@ -189,10 +216,55 @@
 #define MCSPI_XFER_AFL                    (0x07UL << 8)
 #define MCSPI_XFER_AEL                    (0x07UL)
 #define MCSPI_XFER_WCNT                   (0xFFFF << 16)
+#define MCSPI_XFER_WCNT_MAX               0xFFFF
+
+#define MCSPI_XFERLEVEL_AEL(val)          ((u32)(val) << 0)
+#define MCSPI_XFERLEVEL_AFL(val)          ((u32)(val) << 8)
+#define MCSPI_XFERLEVEL_WCNT(val)         ((u32)(val) << 16)
+
+//FIFO depth in bytes when TX and RX share the buffer, and the level at which
+//the almost-empty/almost-full events fire (half of it)
+#define MCSPI_FIFO_DEPTH                  32
+#define MCSPI_FIFO_CHUNK                  (MCSPI_FIFO_DEPTH/2)
+
+//streaming messages of at least this many words are sent with TURBO
+#define MCSPI_TURBO_MIN_WORDS             16
+
+//the functional clock the bit clock is divided down from (CLKD)
+#define MCSPI_FCLK_HZ                     48000000
+//largest one clock granularity divider (CLKG), 12 bits of EXTCLK.CLKD
+#define MCSPI_CLKG_DIV_MAX                4096
+
+//waits expected to take longer than MCSPI_SLEEP_MIN_NS sleep until
+//MCSPI_SPIN_MARGIN_NS before the expected end and only spin after that
+#define MCSPI_SLEEP_MIN_NS                50000
+#define MCSPI_SPIN_MARGIN_NS              10000
+
+
+//------------------- Transfer modes ---------------------
+//(driver side, not a register field)
+#define MCSPI_XFER_MODE_POLL              0x00UL   //one word per TXS/RXS poll
+#define MCSPI_XFER_MODE_FIFO              0x01UL   //burst through the FIFO
+#define MCSPI_XFER_MODE_IRQ               0x02UL   //FIFO fed from the IRQ handler
+#define MCSPI_XFER_MODE_DMA               0x03UL   //FIFO fed by the DMA engine
+#define MCSPI_XFER_MODE_BULK              0x04UL   //FIFO with WCNT, one end wait per block
 
 #ifndef USER_SPACE
+//bits of MCSPI_regs.dirty
+#define MCSPI_REGS_DIRTY_CHCONF(ch)   (1 << (ch))
+#define MCSPI_REGS_DIRTY_MODULCTRL    (1 << MCSPI_NUM_CHANNELS)
+
+//shadow copies of the configuration registers of one MCSPI module, loaded on
+//reset and kept in step with every write after that
+struct MCSPI_regs{
+  u32 modulctrl;
+  u32 chconf[MCSPI_NUM_CHANNELS];
+  u32 dirty;                         //written by the setters, not yet flushed
+};
+
 struct MCSPI{
   void __iomem *base_addr;
+  struct MCSPI_regs *regs;           //shared by all channels of the module
   int  channel_number;                //can be 0,1,2 or 3
   unsigned int role;                 //can be MCSPI_MODULCTRL_MASTER/SLAVE
   unsigned int word_length;          //can be MCSPI_CHCONF_WL_(8/16/32)BIT
@@ -203,8 +275,15 @@ struct MCSPI{
   unsigned int polarity;             //MCSPI_CHCONF_POL_ACTIVE_LOW/HIGH
   unsigned int phase;                //MCSPI_CHCONF_PHA_ODD/EVEN
   unsigned int clock_div;            //Clock divider - CLK_1, 2,..., 16384, 32768
+  unsigned int speed_hz;             //0: clock_div; else fastest clock <= it (CLKG)
+  unsigned int xfer_mode;            //MCSPI_XFER_MODE_POLL/FIFO/IRQ/DMA/BULK
+  unsigned int async;                //1: write() only queues the data
+  unsigned int stream;               //1: CS held for a whole write(), TURBO
 };
 
+//after struct MCSPI, the client contexts in there hold one each
+#include "MCSPI_misc.h"
+
 
 /*..............................................................................
     @breif:      Read/write to the given register
@@ -217,13 +296,22 @@ u32 MCSPI_read_reg(void __iomem *base_addr, u32 reg);
 void MCSPI_write_reg(void __iomem *base_addr,	u32 reg, u32 val);
 
 /*..............................................................................
-    @breif:      Sets the SPI mode MASTER or SLAVE
+    @breif:      Sets the SPI mode MASTER or SLAVE and whether the CS is used
+                 (module wide, for all the channels)
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
 void MCSPI_mode_set(struct MCSPI *dev);
 
 
+/*..............................................................................
+    @breif:      Sets the transmit/receive mode of the channel
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_trm_set(struct MCSPI *dev);
+
+
 /*..............................................................................
     @breif:      Sets the SPI word length for transfer
     @parameters: dev: the device struct for the SPI module
@@ -250,7 +338,7 @@ void MCSPI_enable(struct MCSPI *dev, u8 enable);
 
 
 /*..............................................................................
-    @breif:      Chip select polarity and pin_selection
+    @breif:      Chip select polarity of the channel
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
@@ -258,7 +346,9 @@ void MCSPI_Set_CS(struct MCSPI *dev);
 
 
 /*..............................................................................
-    @breif:      Set Clock divider
+    @breif:      Set Clock divider: the power of two clock_div, or with
+                 speed_hz set the one clock granularity divider for it (the
+                 upper bits of which go to CHCTRL with MCSPI_enable)
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
@@ -266,13 +356,140 @@ void MCSPI_Set_CLKD(struct MCSPI *dev);
 
 
 /*..............................................................................
-    @breif:      Set Clock divider
+    @breif:      Picks the clock for a maximum speed: the one clock granularity
+                 divider of the fastest clock not above hz, or for speeds below
+                 what it reaches the power of two divider that gets under hz.
+                 Only sets dev->speed_hz/clock_div, MCSPI_Set_CLKD writes it
+    @parameters: dev: the device struct for the SPI module
+                 hz: the maximum speed, 0 to go back to dev->clock_div
+    @return:     0; -EINVAL if even the slowest clock is faster than hz (dev
+                 is left as it was)
+..............................................................................*/
+int MCSPI_speed_set(struct MCSPI *dev, u32 hz);
+
+
+/*..............................................................................
+    @breif:      The divider of MCSPI_FCLK_HZ the bit clock of dev runs at
+    @parameters: dev: the device struct for the SPI module
+    @return:     the divider, 1 to 32768
+..............................................................................*/
+u32 MCSPI_clk_divider(struct MCSPI *dev);
+
+
+/*..............................................................................
+    @breif:      Soft reset of the module. Loads the shadow registers with the
+                 reset values
     @parameters: dev: the device struct for the SPI module
     @return:     void
 ..............................................................................*/
 void MCSPI_reset(struct MCSPI *dev);
 
 
+/*..............................................................................
+    @breif:      Writes the shadow registers changed since the last flush, each
+                 of them once. The setters above (mode, TRM, WL, POL/PHA, CS,
+                 CLKD, FIFO) only change the shadows
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_regs_flush(struct MCSPI *dev);
+
+
+/*..............................................................................
+    @breif:      Loads whole precomputed MODULCTRL/CHxCONF words into the
+                 shadows (see MCSPI_profile_set), for MCSPI_regs_flush
+    @parameters: dev: the device struct for the SPI module
+                 modulctrl: the MODULCTRL word
+                 chconf: the CHxCONF word of the channel of dev
+    @return:     void
+..............................................................................*/
+void MCSPI_regs_load(struct MCSPI *dev, u32 modulctrl, u32 chconf);
+
+
+/*..............................................................................
+    @breif:      Writes all the shadow registers back, e.g. after the clock was
+                 gated and the module may have lost its context
+    @parameters: base_addr: the base address of the MCSPI registers
+                 regs: the shadows
+    @return:     void
+..............................................................................*/
+void MCSPI_regs_restore(void __iomem *base_addr, struct MCSPI_regs *regs);
+
+
+/*..............................................................................
+    @breif:      Enables/disables the TX (and RX) FIFO of the channel
+    @parameters: dev: the device struct for the SPI module
+                 enable: can be 0/1 for disable/enable
+    @return:     void
+..............................................................................*/
+void MCSPI_fifo_set(struct MCSPI *dev, u8 enable);
+
+
+/*..............................................................................
+    @breif:      Sets the almost-empty/almost-full levels of the FIFO to a
+                 chunk, with no word count. Channel must be disabled
+    @parameters: dev: the device struct for the SPI module
+    @return:     void
+..............................................................................*/
+void MCSPI_fifo_levels_set(struct MCSPI *dev);
+
+
+/*..............................................................................
+    @breif:      Switches the channel to a one way slave setup and back: receive
+                 (capture) or transmit (responses) only, with just the FIFO of
+                 that direction (which then gets all of the FIFO memory), or
+                 the TRM/FIFO settings of dev again. Written out straight away.
+                 Channel must be disabled
+    @parameters: dev: the device struct for the SPI module
+                 enable: 1 for the one way setup, 0 to go back
+                 tx_rx: MCSPI_CHCONF_TRM_RX or MCSPI_CHCONF_TRM_TX
+    @return:     void
+..............................................................................*/
+void MCSPI_slave_fifo_set(struct MCSPI *dev, u8 enable, unsigned int tx_rx);
+
+
+/*..............................................................................
+    @breif:      Enables/disables the DMA requests of the channel and switches
+                 the FIFO over to the DMA aligned DAFTX/DAFRX registers
+    @parameters: dev: the device struct for the SPI module
+                 enable: can be 0/1 for disable/enable
+    @return:     void
+..............................................................................*/
+void MCSPI_dma_set(struct MCSPI *dev, u8 enable);
+
+
+/*..............................................................................
+    @breif:      Switches a channel off and takes the FIFO and the DMA
+                 requests away from it, before another channel gets the bus
+    @parameters: dev: the device struct for the SPI module
+                 ch: the channel (0-3)
+    @return:     void
+..............................................................................*/
+void MCSPI_channel_release(struct MCSPI *dev, int ch);
+
+
+/*..............................................................................
+    @breif:      Holds the CS of the channel asserted (FORCE) across words and
+                 transfers, or lets it go again. Master mode only, the module
+                 is put in single channel mode for it
+    @parameters: dev: the device struct for the SPI module
+                 force: 1 to assert and hold the CS, 0 to release it
+    @return:     void
+..............................................................................*/
+void MCSPI_cs_force(struct MCSPI *dev, u8 force);
+
+
+/*..............................................................................
+    @breif:      Turns TURBO of the channel on/off: no idle cycles between the
+                 words of a multi word transfer. Only has an effect in single
+                 channel mode (see MCSPI_cs_force). Channel must be disabled
+    @parameters: dev: the device struct for the SPI module
+                 enable: can be 0/1 for disable/enable
+    @return:     void
+..............................................................................*/
+void MCSPI_turbo_set(struct MCSPI *dev, u8 enable);
+
+
 /*..............................................................................
     @breif:      enable/disable SPI0 clock
     @parameters: base_addr: The base address of CM_PER registers
@@ -295,12 +512,58 @@ int MCSPI_wait_for_bit_set(void __iomem *addr, u32 bit, unsigned int timeout);
 int MCSPI_wait_for_bit_reset(void __iomem *addr, u32 bit, unsigned int timeout);
 
 
+/*..............................................................................
+    @breif:      Time the given number of words take on the wire with the bit
+                 clock of dev (MCSPI_FCLK_HZ / MCSPI_clk_divider)
+    @parameters: dev: the device struct for the SPI module
+                 words: the number of words
+    @return:     the time in nanoseconds
+..............................................................................*/
+u64 MCSPI_xfer_time_ns(struct MCSPI *dev, u32 words);
+
+
+/*..............................................................................
+    @breif:      Timeout for a transfer of the given number of words: twice
+                 the expected time, at least 1 ms
+    @parameters: dev: the device struct for the SPI module
+                 words: the number of words
+    @return:     the timeout in milliseconds
+..............................................................................*/
+unsigned int MCSPI_xfer_timeout_ms(struct MCSPI *dev, u32 words);
+
+
+/*..............................................................................
+    @breif:      Same as MCSPI_wait_for_bit_set, but when the bit is expected
+                 to take a while it sleeps until shortly before then and only
+                 spins for the rest. Process context only
+    @parameters: addr: The register address to look for
+                 bit:  the bit for which we are supposed to wait
+                 expect_ns: when the bit is expected to set, from now
+                 timeout: timeout in milliseconds
+    @return:     0 on success; -1 on error
+..............................................................................*/
+int MCSPI_wait_for_bit_set_sleep(void __iomem *addr, u32 bit, u64 expect_ns, unsigned int timeout);
+
+
 void MCSPI_set_bit(void __iomem *addr, u32 bit);
 void MCSPI_reset_bit(void __iomem *addr, u32 bit);
+
+
+/*..............................................................................
+    @breif:      Finds the DT node of a McSPI (there for spi-omap2-mcspi) by the
+                 address of its registers. Its interrupts and dmas are in the
+                 terms of the INTC/EDMA, this driver maps them from there
+    @parameters: start: physical address of the McSPI registers
+    @return:     the node, with a reference (of_node_put it); NULL if none
+..............................................................................*/
+struct device_node *MCSPI_of_node(resource_size_t start);
+
 /*..............................................................................
-    @breif:      IRQ handler for MCSPI controller
+    @breif:      IRQ handler for MCSPI controller. Moves the words of the
+                 transfer in data->xfer between the buffer and the FIFO and
+                 completes data->xfer.done at the end of the word count
     @parameters: irq: the irq number
-                 dev_id: pointer to temp_struct
+                 dev_id: pointer to the struct MCSPI_data
     @return:     whether irq was handled or not
 ..............................................................................*/
 irq_handler_t MCSPI_irq_handler(unsigned int irq, void *dev_id);
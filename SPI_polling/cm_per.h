@@ -16,10 +16,13 @@
 
 //Much more registers but we just need this one for now
 #define CM_PER_SPI0_CLKCTRL   0x4C
+#define CM_PER_SPI1_CLKCTRL   0x50
 
 
 #define CM_PER_SPI0_CLKCTRL_MODULEMODE(val)      ((u32)val<<0)
 #define CM_PER_SPI0_CLKCTRL_MODULEMODE_DISABLE   0x00
 #define CM_PER_SPI0_CLKCTRL_MODULEMODE_ENABLE    0x02
+#define CM_PER_SPI0_CLKCTRL_IDLEST(val)          ((u32)val<<16)
+#define CM_PER_SPI0_CLKCTRL_IDLEST_FUNC          0x00
 
 #endif
@@ -20,6 +20,13 @@
 #define CONF_SPI0_CS0_OFFSET              0x95C
 #define CONF_SPI0_CS1_OFFSET              0x960
 
+//MCSPI1 comes out on the McASP0/eCAP0 pins (P9_28-P9_31, P9_42 on the BBB)
+#define CONF_MCASP0_ACLKX_OFFSET          0x990     //spi1_sclk, mode 3
+#define CONF_MCASP0_FSX_OFFSET            0x994     //spi1_d0, mode 3
+#define CONF_MCASP0_AXR0_OFFSET           0x998     //spi1_d1, mode 3
+#define CONF_MCASP0_AHCLKR_OFFSET         0x99C     //spi1_cs0, mode 3
+#define CONF_ECAP0_IN_PWM0_OUT_OFFSET     0x964     //spi1_cs1, mode 2
+
 #define CONF_MODULE_PIN_SLEWCTRL(val)     (((u32)val)<<6)
 #define CONF_MODULE_PIN_RXACTIVE(val)     (((u32)val)<<5)
 #define CONF_MODULE_PIN_PUTYPESEL(val)    (((u32)val)<<4)
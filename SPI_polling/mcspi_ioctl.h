@@ -26,7 +26,154 @@
 #define MCSPI_TRM_SET            _IOW(MCSPI_MAGIC_NUMBER, 13, __u8)
 #define MCSPI_TRM_GET            _IOR(MCSPI_MAGIC_NUMBER, 14, __u8)
 
-#define MAX_IOCTL_NUMBER         15
+#define MCSPI_XFER_MODE_SET      _IOW(MCSPI_MAGIC_NUMBER, 15, __u8)
+#define MCSPI_XFER_MODE_GET      _IOR(MCSPI_MAGIC_NUMBER, 16, __u8)
+
+#define MCSPI_WL_SET             _IOW(MCSPI_MAGIC_NUMBER, 17, __u8)
+#define MCSPI_WL_GET             _IOR(MCSPI_MAGIC_NUMBER, 18, __u8)
+
+#define MCSPI_ASYNC_SET          _IOW(MCSPI_MAGIC_NUMBER, 19, __u8)
+#define MCSPI_ASYNC_GET          _IOR(MCSPI_MAGIC_NUMBER, 20, __u8)
+#define MCSPI_FLUSH              _IO(MCSPI_MAGIC_NUMBER, 21)
+
+/*
+ *   One segment of MCSPI_IOC_MESSAGE(N). The N segments run in a single ioctl,
+ *   in master mode with the CS held from the first to the last. The received
+ *   words of a message go to rx_buf, not to read()
+ */
+struct mcspi_ioc_transfer{
+  __u64 tx_buf;           //words to send, 0 sends zeros
+  __u64 rx_buf;           //where the received words go, 0 for transmit only
+  __u32 len;              //bytes, a multiple of the word size
+  __u16 delay_usecs;      //wait after this segment
+  __u8  clock_div;        //CLK_DIV_x for this segment, or MCSPI_XFER_KEEP
+  __u8  word_length;      //MCSPI_WL_x for this segment, or MCSPI_XFER_KEEP
+  __u8  cs_change;        //1: release the CS after this segment (not the last:
+                          //the CS is always released after it, EINVAL)
+  __u8  pad[3];
+  __u32 speed_hz;         //maximum speed for this segment (as MCSPI_SPEED_HZ_SET), 0 for clock_div
+};
+
+#define MCSPI_XFER_KEEP          0xFF   //use the setting of the file
+
+#define MCSPI_MSGSIZE(N) \
+  ((((N)*(sizeof (struct mcspi_ioc_transfer))) < (1 << _IOC_SIZEBITS)) \
+    ? ((N)*(sizeof (struct mcspi_ioc_transfer))) : 0)
+#define MCSPI_IOC_MESSAGE(N)     _IOW(MCSPI_MAGIC_NUMBER, 22, char[MCSPI_MSGSIZE(N)])
+
+/*
+ *   A profile for MCSPI_PROFILE_SET: a full set of settings (the same values as
+ *   the _SET commands take) checked once and kept by the driver under index.
+ *   MCSPI_PROFILE_ACTIVATE with the index then switches the file over to it
+ *   in a couple of register writes. Profiles belong to the open file
+ */
+struct mcspi_ioc_profile{
+  __u8  index;            //0 to MCSPI_NUM_PROFILES-1
+  __u8  mode;             //MCSPI_MODE_x
+  __u8  polarity;         //MCSPI_POL_x
+  __u8  phase;            //MCSPI_PHA_x
+  __u8  pin_config;       //MCSPI_PIN_CONFIG_x
+  __u8  clock_div;        //CLK_DIV_x
+  __u8  cs;               //MCSPI_CS_x
+  __u8  trm;              //MCSPI_TRM_x
+  __u8  word_length;      //MCSPI_WL_x
+  __u8  xfer_mode;        //MCSPI_XFER_x
+  __u8  pad[2];
+  __u32 speed_hz;         //maximum speed (as MCSPI_SPEED_HZ_SET), 0 for clock_div
+};
+
+#define MCSPI_PROFILE_SET        _IOW(MCSPI_MAGIC_NUMBER, 23, struct mcspi_ioc_profile)
+#define MCSPI_PROFILE_ACTIVATE   _IOW(MCSPI_MAGIC_NUMBER, 24, __u8)
+
+/*
+ *   MCSPI_IOC_XFER_MAPPED sends len bytes from offset in the buffer mmap()ed
+ *   from the file (up to 1 MB, mapped at offset 0) and leaves the received
+ *   words in their place. Nothing is copied to or from user space, and the
+ *   received words don't go to read(). offset must be a multiple of the word
+ *   size
+ */
+struct mcspi_ioc_mapped{
+  __u32 offset;           //bytes into the mapping
+  __u32 len;              //bytes, a multiple of the word size
+};
+
+#define MCSPI_IOC_XFER_MAPPED    _IOW(MCSPI_MAGIC_NUMBER, 25, struct mcspi_ioc_mapped)
+
+/*
+ *   Slave capture. MCSPI_CAPTURE_START (slave mode only, needs the IRQ) makes
+ *   the channel receive only and has the driver drain it continuously into a
+ *   1 MB ring, which read()/poll() then drain. The argument is the frame length
+ *   in words: the frames are counted from the words received, 0 for no
+ *   frames. No other transfer gets the controller until MCSPI_CAPTURE_STOP (or
+ *   close()); what was captured can still be read after that.
+ *   MCSPI_CAPTURE_STATS reports the counters since the start
+ */
+struct mcspi_ioc_capture_stats{
+  __u64 words;            //words received
+  __u64 dropped;          //of those, lost because the ring was full
+  __u32 frames;           //frames completed
+  __u32 fifo_overflows;   //RX FIFO overflows (channel 0 only), words lost
+  __u32 running;          //1 while the capture is on
+  __u32 pad;
+};
+
+#define MCSPI_CAPTURE_START      _IOW(MCSPI_MAGIC_NUMBER, 26, __u32)
+#define MCSPI_CAPTURE_STOP       _IO(MCSPI_MAGIC_NUMBER, 27)
+#define MCSPI_CAPTURE_STATS      _IOR(MCSPI_MAGIC_NUMBER, 28, struct mcspi_ioc_capture_stats)
+
+/*
+ *   Slave responses. MCSPI_RESPONSE_STAGE copies a response (packed words, up
+ *   to 4 KB) into the driver; MCSPI_RESPONSE_START (slave mode only, needs the
+ *   IRQ, a response must be staged) makes the channel transmit only and has it
+ *   sent as soon as the master clocks: one transaction per response, its
+ *   length in words is the transaction length. While a transaction runs the
+ *   next response can be staged; it follows the current one, otherwise the
+ *   last one is sent again. The channel runs on without a stop between the
+ *   transactions, so the FIFO is up to 64 bytes ahead of the master: a
+ *   response goes out after those already in it, and the master has to clock
+ *   whole responses. MCSPI_RESPONSE_STAGE returns -EAGAIN
+ *   while a staged response is still waiting, poll() reports POLLOUT once it
+ *   has been taken. MCSPI_RESPONSE_STOP (or close()) gives the controller back
+ */
+struct mcspi_ioc_response{
+  __u64 buf;              //pointer to the words
+  __u32 len;              //bytes, a multiple of the word size
+  __u32 pad;
+};
+
+struct mcspi_ioc_response_stats{
+  __u32 transactions;     //responses put into the FIFO since MCSPI_RESPONSE_START
+  __u32 repeats;          //of those, followed by the same response again
+  __u32 underflows;       //TX FIFO underflows (channel 0 only)
+  __u32 staged;           //1 while a staged response waits to be swapped in
+};
+
+#define MCSPI_RESPONSE_STAGE     _IOW(MCSPI_MAGIC_NUMBER, 29, struct mcspi_ioc_response)
+#define MCSPI_RESPONSE_START     _IO(MCSPI_MAGIC_NUMBER, 30)
+#define MCSPI_RESPONSE_STOP      _IO(MCSPI_MAGIC_NUMBER, 31)
+#define MCSPI_RESPONSE_STATS     _IOR(MCSPI_MAGIC_NUMBER, 32, struct mcspi_ioc_response_stats)
+
+/*
+ *   Streaming: in master mode the CS stays asserted (FORCE) for the whole of a
+ *   write(), and a write() of at least 16 words is sent with TURBO, without
+ *   idle cycles between the words.
+ */
+#define MCSPI_STREAM_SET         _IOW(MCSPI_MAGIC_NUMBER, 33, __u8)
+#define MCSPI_STREAM_GET         _IOR(MCSPI_MAGIC_NUMBER, 34, __u8)
+
+/*
+ *   MCSPI_SPEED_HZ_SET takes the maximum speed of the slave in Hz: the clock is
+ *   the fastest the one clock granularity divider of the 48 MHz reference gets
+ *   without going over it (48 MHz/N, N = 1..4096; below that the power of two
+ *   dividers). The call returns the clock actually picked in Hz, or -1 with
+ *   errno EINVAL for 0 or a speed below 48 MHz/32768. MCSPI_CLKD_SET goes back
+ *   to the CLK_DIV_x divider. MCSPI_SPEED_HZ_GET reports the clock the file
+ *   runs at
+ */
+#define MCSPI_SPEED_HZ_SET       _IOW(MCSPI_MAGIC_NUMBER, 35, __u32)
+#define MCSPI_SPEED_HZ_GET       _IOR(MCSPI_MAGIC_NUMBER, 36, __u32)
+
+#define MAX_IOCTL_NUMBER         37
 
 
  /*
@@ -75,6 +222,17 @@
 #define MCSPI_TRM_RX                          MCSPI_CHCONF_TRM_RX
 #define MCSPI_TRM_TX_RX                       MCSPI_CHCONF_TRM_TX_RX
 
+//write()/read() buffers are packed u8/u16/u32 words for these word lengths
+#define MCSPI_WL_8BIT                         MCSPI_CHCONF_WL_8BIT
+#define MCSPI_WL_16BIT                        MCSPI_CHCONF_WL_16BIT
+#define MCSPI_WL_32BIT                        MCSPI_CHCONF_WL_32BIT
+
+#define MCSPI_XFER_POLL                       MCSPI_XFER_MODE_POLL
+#define MCSPI_XFER_FIFO                       MCSPI_XFER_MODE_FIFO
+#define MCSPI_XFER_IRQ                        MCSPI_XFER_MODE_IRQ
+#define MCSPI_XFER_DMA                        MCSPI_XFER_MODE_DMA
+#define MCSPI_XFER_BULK                       MCSPI_XFER_MODE_BULK
+
 #undef  USER_SPACE
 
 #endif
@@ -27,7 +27,7 @@ int main(){
    char *test = (char *)"hel";
    char *test1 = (char *)"ho";
    printf("Starting device test code example...\n");
-   fd = open("/dev/MCSPI", O_RDWR);             // Open the device with read/write access
+   fd = open("/dev/MCSPI0.0", O_RDWR);             // Open the device with read/write access
    if (fd < 0){
       perror("Failed to open the device...");
       return errno;